@@ -0,0 +1,334 @@
+/*
+* Copyright (c) 2024 Aymeric Wibo
+*
+* @APPLE_LICENSE_HEADER_START@
+*
+* This file contains Original Code and/or Modifications of Original Code
+* as defined in and that are subject to the Apple Public Source License
+* Version 2.0 (the 'License'). You may not use this file except in
+* compliance with the License. Please obtain a copy of the License at
+* http://www.opensource.apple.com/apsl/ and read it before using this
+* file.
+*
+* The Original Code and all software distributed under the License are
+* distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+* EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+* INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+* Please see the License for the specific language governing rights and
+* limitations under the License.
+*
+* @APPLE_LICENSE_HEADER_END@
+*/
+
+/*
+* Benchmark harness for libcopyfile: copies files of a range of sizes
+* (dense and sparse) with each data engine, and trees of many small
+* files, within the scratch directory's filesystem and, if given one, to
+* another.  Each case is run a few times and the median run reported as
+* a tab-separated line, after a header line starting with '#'.
+*/
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/types.h>
+
+#include "copyfile.h"
+
+#define KiB	(1024LL)
+#define MiB	(1024 * KiB)
+#define GiB	(1024 * MiB)
+
+/* the file sizes tried, up to -m */
+static const off_t sizes[] = { 4 * KiB, 64 * KiB, MiB, 16 * MiB, 256 * MiB, GiB, 10 * GiB };
+
+/*
+* The ways of copying data tried on every file.  "chunked" is the same as
+* "auto", except that files are split between one thread per CPU.
+*/
+static const struct engine
+{
+	const char *name;
+	int engine;
+	unsigned threads;
+} engines[] = {
+	{ "auto",	COPYFILE_ENGINE_AUTO,		1 },
+	{ "loop",	COPYFILE_ENGINE_LOOP,		1 },
+	{ "kernel",	COPYFILE_ENGINE_KERNEL,		1 },
+	{ "mmap",	COPYFILE_ENGINE_MMAP,		1 },
+	{ "pipeline",	COPYFILE_ENGINE_PIPELINE,	1 },
+	{ "chunked",	COPYFILE_ENGINE_AUTO,		0 },
+};
+
+/* what a single run measured */
+struct result
+{
+	double secs;
+	double user;
+	double sys;
+	struct copyfile_stats stats;
+};
+
+static int nruns = 5;
+
+static double tv_secs(const struct timeval *tv)
+{
+	return tv->tv_sec + tv->tv_usec / 1e6;
+}
+
+static off_t parse_size(const char *s)
+{
+	char *end;
+	off_t n = strtoll(s, &end, 10);
+
+	switch (*end)
+	{
+	case 'k': case 'K': n *= KiB; break;
+	case 'm': case 'M': n *= MiB; break;
+	case 'g': case 'G': n *= GiB; break;
+	case '\0': break;
+	default: errx(1, "bad size: %s", s);
+	}
+
+	return n;
+}
+
+static int rm_entry(const char *path, const struct stat *sb, int type, struct FTW *ftw)
+{
+	(void)sb;
+	(void)type;
+	(void)ftw;
+
+	return remove(path);
+}
+
+/* remove a file or a whole tree, if it's there at all */
+static void rm_rf(const char *path)
+{
+	if (nftw(path, rm_entry, 64, FTW_DEPTH | FTW_PHYS) < 0 && errno != ENOENT)
+		err(1, "removing %s", path);
+}
+
+/*
+* Write a file of size bytes of noise (so that no filesystem compresses
+* it away): all of it if dense, otherwise 64 KiB of every MiB, leaving
+* the rest as holes.  Files already there at the right size are reused.
+*/
+static void make_file(const char *path, off_t size, int sparse)
+{
+	static char buf[MiB];
+	static uint64_t x = 0x9e3779b97f4a7c15ULL;
+	struct stat sb;
+	off_t off;
+	size_t i, len;
+	int fd;
+
+	if (stat(path, &sb) == 0 && sb.st_size == size)
+		return;
+
+	for (i = 0; i < sizeof buf; i += sizeof x)
+	{
+		x ^= x << 13;
+		x ^= x >> 7;
+		x ^= x << 17;
+		memcpy(buf + i, &x, sizeof x);
+	}
+
+	if ((fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0)
+		err(1, "creating %s", path);
+
+	if (sparse && ftruncate(fd, size) < 0)
+		err(1, "truncating %s", path);
+
+	for (off = 0; off < size; off += MiB)
+	{
+		len = (size_t)(size - off < MiB ? size - off : MiB);
+		if (sparse && len > 64 * KiB)
+			len = 64 * KiB;
+		if (pwrite(fd, buf, len, off) != (ssize_t)len)
+			err(1, "writing %s", path);
+	}
+
+	if (fsync(fd) < 0 || close(fd) < 0)
+		err(1, "writing %s", path);
+}
+
+/* a tree of n files of 4 KiB, 100 to a directory */
+static void make_tree(const char *path, int n)
+{
+	char name[1024];
+	int i;
+
+	snprintf(name, sizeof name, "%s/%d", path, n - 1);
+	if (access(name, F_OK) == 0)
+		return;
+
+	rm_rf(path);
+	if (mkdir(path, 0755) < 0)
+		err(1, "creating %s", path);
+
+	for (i = 0; i < n; i += 100)
+	{
+		snprintf(name, sizeof name, "%s/d%d", path, i / 100);
+		if (mkdir(name, 0755) < 0)
+			err(1, "creating %s", name);
+	}
+
+	for (i = 0; i < n; i++)
+	{
+		snprintf(name, sizeof name, "%s/d%d/%d", path, i / 100, i);
+		make_file(name, 4 * KiB, 0);
+	}
+
+	/* so it can tell when the tree is complete */
+	snprintf(name, sizeof name, "%s/%d", path, n - 1);
+	make_file(name, 0, 0);
+}
+
+static void run_once(const char *src, const char *dst, const struct engine *e, copyfile_flags_t flags, struct result *r)
+{
+	struct rusage before, after;
+	struct timespec start, end;
+	copyfile_state_t s;
+	off_t threshold = 1;
+
+	rm_rf(dst);
+
+	if ((s = copyfile_state_alloc()) == NULL)
+		err(1, "copyfile_state_alloc");
+
+	if (copyfile_state_set(s, COPYFILE_STATE_ENGINE, &e->engine) < 0 ||
+	    copyfile_state_set(s, COPYFILE_STATE_THREADS, &e->threads) < 0 ||
+	    (e->threads != 1 && copyfile_state_set(s, COPYFILE_STATE_CHUNK_THRESHOLD, &threshold) < 0))
+		err(1, "copyfile_state_set");
+
+	getrusage(RUSAGE_SELF, &before);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	if (copyfile(src, dst, s, flags) < 0)
+		err(1, "copying %s to %s", src, dst);
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	getrusage(RUSAGE_SELF, &after);
+
+	r->secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+	r->user = tv_secs(&after.ru_utime) - tv_secs(&before.ru_utime);
+	r->sys = tv_secs(&after.ru_stime) - tv_secs(&before.ru_stime);
+
+	if (copyfile_state_get(s, COPYFILE_STATE_STATS, &r->stats) < 0)
+		err(1, "copyfile_state_get");
+
+	copyfile_state_free(s);
+}
+
+static int by_secs(const void *a, const void *b)
+{
+	const struct result *ra = a, *rb = b;
+
+	return (ra->secs > rb->secs) - (ra->secs < rb->secs);
+}
+
+/*
+* Run one case nruns times and report the median run.  size is the
+* logical size copied, for the throughput: holes count, since skipping
+* them quickly is the point.
+*/
+static void bench(const char *kind, const char *src, const char *dst, const struct engine *e,
+    off_t size, const char *layout, const char *fs, copyfile_flags_t flags)
+{
+	struct result runs[64], *r;
+	int i;
+
+	for (i = 0; i < nruns; i++)
+		run_once(src, dst, e, flags, &runs[i]);
+
+	rm_rf(dst);
+
+	qsort(runs, nruns, sizeof *runs, by_secs);
+	r = &runs[nruns / 2];
+
+	printf("%s\t%s\t%jd\t%s\t%s\t%u\t%d\t%.6f\t%.2f\t%.2f\t%ju\t%.6f\t%.6f\n",
+	    kind, e->name, (intmax_t)size, layout, fs, e->threads, nruns, r->secs,
+	    size / r->secs / 1e6, r->stats.files / r->secs, (uintmax_t)r->stats.syscalls,
+	    r->user, r->sys);
+	fflush(stdout);
+}
+
+static void usage(void)
+{
+	fprintf(stderr, "usage: copyfile-bench [-d scratch] [-x other-fs] [-m max-size] [-n tree-files] [-r runs]\n");
+	exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	const char *dir = "/tmp/copyfile-bench";
+	const char *xdir = NULL;
+	off_t max = GiB;
+	int nfiles = 10000;
+	char src[1024], dst[1024];
+	const char *fs;
+	size_t i, j;
+	int ch, sparse, cross;
+
+	while ((ch = getopt(argc, argv, "d:x:m:n:r:")) != -1)
+	{
+	switch (ch)
+	{
+	case 'd': dir = optarg; break;
+	case 'x': xdir = optarg; break;
+	case 'm': max = parse_size(optarg); break;
+	case 'n': nfiles = atoi(optarg); break;
+	case 'r': nruns = atoi(optarg); break;
+	default: usage();
+	}
+	}
+
+	if (nruns < 1 || nruns > 64 || nfiles < 1)
+		usage();
+
+	if (mkdir(dir, 0755) < 0 && errno != EEXIST)
+		err(1, "creating %s", dir);
+
+	printf("#kind\tengine\tsize\tlayout\tfs\tthreads\truns\tsecs\tmb_per_s\tfiles_per_s\tsyscalls\tuser_secs\tsys_secs\n");
+
+	for (cross = 0; cross <= (xdir != NULL); cross++)
+	{
+	fs = cross ? "cross" : "same";
+
+	for (i = 0; i < sizeof sizes / sizeof *sizes && sizes[i] <= max; i++)
+	for (sparse = 0; sparse <= (sizes[i] >= MiB); sparse++)
+	{
+		snprintf(src, sizeof src, "%s/src-%jd-%s", dir, (intmax_t)sizes[i], sparse ? "sparse" : "dense");
+		snprintf(dst, sizeof dst, "%s/dst", cross ? xdir : dir);
+		make_file(src, sizes[i], sparse);
+
+		for (j = 0; j < sizeof engines / sizeof *engines; j++)
+			bench("file", src, dst, &engines[j], sizes[i], sparse ? "sparse" : "dense", fs,
+			    COPYFILE_ALL | COPYFILE_STAT | (sparse ? COPYFILE_DATA_SPARSE : 0));
+	}
+
+	snprintf(src, sizeof src, "%s/src-tree-%d", dir, nfiles);
+	snprintf(dst, sizeof dst, "%s/dst", cross ? xdir : dir);
+	make_tree(src, nfiles);
+
+	/* trees use the threads for their entries, "chunked" or not */
+	bench("tree", src, dst, &engines[0], (off_t)nfiles * 4 * KiB, "dense", fs,
+	    COPYFILE_ALL | COPYFILE_STAT | COPYFILE_RECURSIVE);
+	bench("tree", src, dst, &engines[5], (off_t)nfiles * 4 * KiB, "dense", fs,
+	    COPYFILE_ALL | COPYFILE_STAT | COPYFILE_RECURSIVE);
+	}
+
+	return 0;
+}
@@ -0,0 +1,51 @@
+#!/bin/sh
+# Copyright (c) 2024 Aymeric Wibo
+#
+# @APPLE_LICENSE_HEADER_START@
+#
+# This file contains Original Code and/or Modifications of Original Code
+# as defined in and that are subject to the Apple Public Source License
+# Version 2.0 (the 'License'). You may not use this file except in
+# compliance with the License. Please obtain a copy of the License at
+# http://www.opensource.apple.com/apsl/ and read it before using this
+# file.
+#
+# The Original Code and all software distributed under the License are
+# distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+# EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+# INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+# FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+# Please see the License for the specific language governing rights and
+# limitations under the License.
+#
+# @APPLE_LICENSE_HEADER_END@
+
+# Build the same libraries as build.fl, but with the DTrace probes of
+# src/copyfile_provider.d compiled in, which takes dtrace(1) to generate
+# their header and, once the library's object is compiled, the object
+# that registers them.  Everything goes in the directory given (.dtrace
+# by default), and is then installed under $PREFIX, if it's set, where
+# "bob install" would put it.
+
+set -e
+
+out=${1:-.dtrace}
+cc=${CC:-cc}
+cflags="-fPIC -std=c99 -pthread -Wall -Wextra -Werror"
+
+mkdir -p "$out"
+
+dtrace -h -s src/copyfile_provider.d -o "$out/copyfile_provider.h"
+$cc $cflags -DCOPYFILE_DTRACE -I"$out" -c src/copyfile.c -o "$out/copyfile.o"
+dtrace -G -s src/copyfile_provider.d -o "$out/copyfile_provider.o" "$out/copyfile.o"
+
+rm -f "$out/libcopyfile.a"
+ar rcs "$out/libcopyfile.a" "$out/copyfile.o" "$out/copyfile_provider.o"
+$cc -shared -pthread "$out/copyfile.o" "$out/copyfile_provider.o" -o "$out/libcopyfile.so"
+
+if [ -n "$PREFIX" ]; then
+	mkdir -p "$PREFIX/lib" "$PREFIX/include"
+	install -m 644 "$out/libcopyfile.a" "$PREFIX/lib/libcopyfile.a"
+	install -m 755 "$out/libcopyfile.so" "$PREFIX/lib/libcopyfile.so"
+	install -m 644 src/copyfile.h "$PREFIX/include/copyfile.h"
+fi
@@ -27,6 +27,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <limits.h>
 #include <stdint.h>
 #include <syslog.h>
 #include <unistd.h>
@@ -34,20 +35,105 @@
 #include <sys/errno.h>
 #include <sys/stat.h>
 #include <sys/time.h>
+#include <time.h>
 #include <sys/syscall.h>
 #include <sys/param.h>
 #include <sys/mount.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/extattr.h>
+#include <dirent.h>
+#include <pthread.h>
 
 #include "copyfile.h"
 
+/* copy_file_range(2) appeared in FreeBSD 13.0 */
+#if defined(__FreeBSD_version) && __FreeBSD_version >= 1300037
+# define HAVE_COPY_FILE_RANGE 1
+#endif
+
+/* ... and can be told to clone blocks or fail since FreeBSD 15.0 */
+#if defined(HAVE_COPY_FILE_RANGE) && defined(COPY_FILE_RANGE_CLONE)
+# define HAVE_COPY_FILE_CLONE 1
+#endif
+
+/*
+* What a state has found out about a filesystem, by device: its
+* f_iosize (0 until needed), and whether it turned out not to support
+* preallocation or extended attributes, so as not to ask again.
+*/
+struct copyfile_fs
+{
+	dev_t dev;
+	size_t iosize;
+	int nofalloc;
+	int noxattr;
+};
+
+/* how many filesystems a state remembers */
+#define COPYFILE_FS_CACHE	4
+
+/*
+* COPYFILE_STATE_RATE_BYTES and COPYFILE_STATE_RATE_OPS, as token buckets
+* holding up to a tenth of a second's worth (COPYFILE_THROTTLE_BURST),
+* overdrawn by whatever was just done and then waited on until they're
+* back in credit.  The state's own is shared by the states copying a
+* tree or batch on its behalf, so they all point at it, and it has a
+* lock so that the rates can be changed from another thread.
+*/
+struct copyfile_throttle
+{
+	pthread_mutex_t lock;
+	uint64_t bps;
+	uint64_t ops;
+	double bytes;
+	double nops;
+	uint64_t last;
+};
+
+/*
+* The longest to wait at once, so that new rates are seen soon enough, and
+* how much a throttle's allowance builds up to while unused.
+*/
+#define COPYFILE_THROTTLE_SLICE	(100 * 1000 * 1000)
+#define COPYFILE_THROTTLE_BURST(rate)	((double)(rate) * COPYFILE_THROTTLE_SLICE / 1e9)
+
 /*
-* The state structure keeps track of
-* the source filename, the destination filename, their
-* associated file-descriptors, the stat infomration for the
-* source file, the security information for the source file,
-* the flags passed in for the copy, a pointer to place statistics
-* (not currently implemented), debug flags, and a pointer to callbacks
-* (not currently implemented).
+* The state structure keeps track of the source filename, the
+* destination filename, their associated file-descriptors, the stat
+* infomration for the source file, the security information for the
+* source file, the flags passed in for the copy, the statistics gathered
+* so far, debug flags, the progress callback along with how often (in
+* bytes of the current file) to call it, which engine to copy the data
+* with (COPYFILE_ENGINE_*), which checksum to compute over the data (and
+* whether one is being computed for the current file, with its running
+* value and the last file's digest), whether the last file's data was
+* cloned or found to be up to date already (and whether COPYFILE_UPDATE
+* should compare the data to tell), the I/O block size to use for the
+* data (0 to pick one automatically), and whether to preallocate the
+* destination.  direct says the current file's descriptors were put in
+* O_DIRECT mode by COPYFILE_NOCACHE, and dropped how much of it has been
+* dropped from the cache already.  The filenames are looked up relative
+* to src_dirfd and dst_dirfd, which are AT_FDCWD unless given to
+* copyfileat() or we're copying a tree.  sock says the destination is a
+* socket, which fcopyfile() may be given.  nthreads says how many
+* threads to copy a tree (or batch, or a file of at least
+* chunk_threshold bytes in chunks of chunk_size) with, 0 meaning one per
+* CPU.  noxdev is set once COPYFILE_MOVE found it can't rename across
+* devices.  tmp is the name COPYFILE_ATOMIC is writing the destination
+* under, and syncfds the nsync descriptors COPYFILE_DURABILITY_GROUP has
+* yet to fsync().  manifest is COPYFILE_STATE_MANIFEST, and created says
+* copyfile_open() had to make the destination, file or directory.
+* dst_sb is what was last seen of the destination, if dst_sb_ok: its
+* mode, owner and flags, which copying the data leaves as they were.
+* Finally, buf is the data buffer, kept from one copy to the next, and
+* xbuf the one extended attributes go through, along with whether the
+* system namespace turned out to be off limits.  srcbuf and dstbuf are
+* where src and dst are kept, when they're our own copies, likewise
+* reused, and fs what's been found out about the last few filesystems.
+* tb is the throttle this state answers to, its own or its parent's, and
+* tb_syscalls how many of its system calls it's been charged for.
 */
 struct _copyfile_state
 {
@@ -55,11 +141,56 @@ struct _copyfile_state
 	char *dst;
 	int src_fd;
 	int dst_fd;
+	int src_dirfd;
+	int dst_dirfd;
+	int sock;
 	struct stat sb;
 	copyfile_flags_t flags;
-	void *stats;
+	struct copyfile_stats stats;
 	uint32_t debug;
-	void *callbacks;
+	copyfile_progress_t progress;
+	void *progress_ctx;
+	off_t progress_interval;
+	off_t copied;
+	off_t progress_next;
+	int engine;
+	int checksum;
+	int hashing;
+	uint32_t crc;
+	uint32_t digest;
+	int cloned;
+	int uptodate;
+	int update_compare;
+	int noxdev;
+	char *tmp;
+	int durability;
+	int *syncfds;
+	size_t nsync;
+	char *manifest;
+	int created;
+	struct stat dst_sb;
+	int dst_sb_ok;
+	size_t blksize;
+	int prealloc;
+	int direct;
+	off_t dropped;
+	unsigned nthreads;
+	off_t chunk_threshold;
+	off_t chunk_size;
+	char *buf;
+	size_t buflen;
+	char *xbuf;
+	size_t xbuflen;
+	int nosysattr;
+	char *srcbuf;
+	size_t srcbuflen;
+	char *dstbuf;
+	size_t dstbuflen;
+	struct copyfile_fs fs[COPYFILE_FS_CACHE];
+	unsigned nfs;
+	struct copyfile_throttle throttle;
+	struct copyfile_throttle *tb;
+	uint64_t tb_syscalls;
 };
 
 /*
@@ -69,7 +200,22 @@ struct _copyfile_state
 static int copyfile_open	(copyfile_state_t);
 static int copyfile_close	(copyfile_state_t);
 static int copyfile_data	(copyfile_state_t);
+static int copyfile_xattr	(copyfile_state_t);
 static int copyfile_stat	(copyfile_state_t);
+static int copyfile_tree	(copyfile_state_t);
+static int copyfile_uptodate	(copyfile_state_t);
+static int copyfile_run		(copyfile_state_t);
+
+static int copyfile_remove(int dirfd, const char *name);
+static int copyfile_move(copyfile_state_t s, int src_dirfd, const char *src, int dst_dirfd, const char *dst);
+static int copyfile_sync(copyfile_state_t s, int fd, int own);
+static int copyfile_sync_flush(copyfile_state_t s);
+static int copyfile_sync_parent(copyfile_state_t s);
+static int copyfile_atomic_commit(copyfile_state_t s);
+static void copyfile_throttle_charge(copyfile_state_t s, uint64_t bytes);
+
+static copyfile_state_t copyfile_state_child(copyfile_state_t);
+static void copyfile_stats_add(struct copyfile_stats *, const struct copyfile_stats *);
 
 static int copyfile_preamble(copyfile_state_t *s, copyfile_flags_t flags);
 static int copyfile_internal(copyfile_state_t state, copyfile_flags_t flags);
@@ -77,6 +223,87 @@ static int copyfile_internal(copyfile_state_t state, copyfile_flags_t flags);
 #define COPYFILE_DEBUG (1<<31)
 #define COPYFILE_DEBUG_VAR "COPYFILE_DEBUG"
 
+/*
+* Bounds for the automatic block size: the largest buffer it may grow
+* to, and how many chunks (and at least how many bytes) are timed before
+* deciding whether to grow.
+*/
+#define COPYFILE_BLOCKSIZE_MAX	(8 * 1024 * 1024)
+#define COPYFILE_TUNE_CHUNKS	4
+#define COPYFILE_TUNE_BYTES	(1024 * 1024)
+
+/*
+* Sources at least this big are mmap()ed by COPYFILE_ENGINE_AUTO if the
+* kernel can't copy them itself, a window of this size at a time.
+*/
+#define COPYFILE_MMAP_THRESHOLD	(8 * 1024 * 1024)
+#define COPYFILE_MMAP_WINDOW	(8 * 1024 * 1024)
+
+/*
+* How many buffers COPYFILE_ENGINE_PIPELINE's reader may fill ahead, and
+* how big they are when COPYFILE_STATE_BLOCKSIZE is left to us: the
+* pipeline doesn't tune itself, so start from something sensible.
+*/
+#define COPYFILE_PIPELINE_DEPTH	4
+#define COPYFILE_PIPELINE_BLOCK	(1024 * 1024)
+
+/*
+* Defaults for COPYFILE_STATE_CHUNK_THRESHOLD and COPYFILE_STATE_CHUNK_SIZE,
+* and how big a buffer each thread copies a chunk through.
+*/
+#define COPYFILE_CHUNK_THRESHOLD	(1024LL * 1024 * 1024)
+#define COPYFILE_CHUNK_SIZE	(32 * 1024 * 1024)
+#define COPYFILE_CHUNK_BLOCK	(1024 * 1024)
+
+/*
+* The block size COPYFILE_DATA_DELTA compares the files by, if neither
+* COPYFILE_STATE_BLOCKSIZE nor the destination's filesystem suggest one,
+* and how much (in whole blocks) it reads at a time.
+*/
+#define COPYFILE_DELTA_BLOCK	(128 * 1024)
+#define COPYFILE_DELTA_WINDOW	(1024 * 1024)
+
+/* how much of a partial destination COPYFILE_RESUME checks, at most */
+#define COPYFILE_RESUME_WINDOW	(1024 * 1024)
+
+/* how big the extended attribute buffer starts out */
+#define COPYFILE_XATTR_BUF	4096
+
+/* how much of the destination COPYFILE_VERIFY reads back at a time */
+#define COPYFILE_VERIFY_BLOCK	(1024 * 1024)
+
+/* files up to this big are copied with a single read(2) and write(2) */
+#define COPYFILE_SMALL_FILE	(64 * 1024)
+
+/* how much of each file COPYFILE_STATE_UPDATE_COMPARE reads at a time */
+#define COPYFILE_COMPARE_BLOCK	(128 * 1024)
+
+/* how many descriptors COPYFILE_DURABILITY_GROUP holds before fsync()ing them */
+#define COPYFILE_SYNC_GROUP	64
+
+/*
+* COPYFILE_NOCACHE: the block size to copy with under direct I/O, if
+* COPYFILE_STATE_BLOCKSIZE doesn't say, and how far behind the copy to
+* let the data pile up in the cache before dropping it.
+*/
+#define COPYFILE_NOCACHE_BLOCK	(1024 * 1024)
+#define COPYFILE_NOCACHE_WINDOW	(8 * 1024 * 1024)
+
+/* default for COPYFILE_STATE_PROGRESS_INTERVAL */
+#define COPYFILE_PROGRESS_INTERVAL	(1024 * 1024)
+
+/* tally a system call made on behalf of the copy, for COPYFILE_STATE_STATS */
+#define copyfile_syscall(s)	((s)->stats.syscalls++)
+
+/*
+* Whether COPYFILE_MOVE may rename the source instead of copying it: not
+* if renames already turned out to cross devices, nor if there's a
+* checksum wanted, which only a copy computes.
+*/
+#define copyfile_can_move(s) \
+	(((s)->flags & (COPYFILE_MOVE | COPYFILE_DATA)) == (COPYFILE_MOVE | COPYFILE_DATA) && \
+	!(s)->noxdev && (s)->checksum == COPYFILE_CHECKSUM_NONE && !((s)->flags & COPYFILE_VERIFY))
+
 #ifndef _COPYFILE_TEST
 # define copyfile_warn(str, ...) syslog(LOG_WARNING, str ": %m", ## __VA_ARGS__)
 # define copyfile_debug(d, str, ...) \
@@ -96,6 +323,127 @@ do { \
 	} while(0)
 #endif
 
+/*
+* Static DTrace probes on the phases of a copy, described in
+* copyfile_provider.d.  build-dtrace.sh builds with COPYFILE_DTRACE
+* defined, which makes them real, from the header "dtrace -h" generates;
+* otherwise they compile to nothing at all.
+*/
+#ifdef COPYFILE_DTRACE
+# include "copyfile_provider.h"
+#else
+# define COPYFILE_OPEN_START(src, dst)	do { } while (0)
+# define COPYFILE_OPEN_DONE(src, dst, ret)	do { } while (0)
+# define COPYFILE_XATTR_START(src, dst)	do { } while (0)
+# define COPYFILE_XATTR_DONE(src, dst, ret)	do { } while (0)
+# define COPYFILE_DATA_START(src, dst, size)	do { } while (0)
+# define COPYFILE_DATA_CHUNK(src, bytes, copied)	do { } while (0)
+# define COPYFILE_DATA_DONE(src, dst, copied, ret)	do { } while (0)
+# define COPYFILE_STAT_START(src, dst)	do { } while (0)
+# define COPYFILE_STAT_DONE(src, dst, ret)	do { } while (0)
+#endif
+
+/* paths as given to the probes, which fcopyfile() doesn't have */
+#define copyfile_probe_path(p)	((p) != NULL ? (const char *)(p) : "")
+
+/*
+* Monotonic time in nanoseconds, for the statistics.
+*/
+static uint64_t copyfile_now(void)
+{
+	struct timespec ts;
+
+	(void)clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+* Allocate a data buffer of len bytes, page aligned so that it can be
+* used for direct I/O.
+*/
+static void *copyfile_buf_alloc(size_t len)
+{
+	void *p;
+	int err;
+
+	if ((err = posix_memalign(&p, (size_t)sysconf(_SC_PAGESIZE), len)) != 0)
+	{
+	errno = err;
+	return NULL;
+	}
+
+	return p;
+}
+
+/*
+* Point *name at a copy of str, made in *buf (of *len bytes), which is
+* kept from one copy to the next so that names don't each need a trip
+* to the allocator.
+*/
+static int copyfile_name(char **name, char **buf, size_t *len, const char *str)
+{
+	size_t n = strlen(str) + 1;
+	char *nbuf;
+
+	if (str == *buf)
+	{
+	*name = *buf;
+	return 0;
+	}
+
+	if (n > *len)
+	{
+	if ((nbuf = malloc(MAX(n, MAXPATHLEN))) == NULL)
+		return -1;
+	memcpy(nbuf, str, n);
+	free(*buf);
+	*buf = nbuf;
+	*len = MAX(n, MAXPATHLEN);
+	}
+	else
+	memmove(*buf, str, n);
+
+	*name = *buf;
+	return 0;
+}
+
+/*
+* The state's entry for the filesystem on dev, made in place of the
+* oldest one if there isn't one yet.
+*/
+static struct copyfile_fs *copyfile_fs(copyfile_state_t s, dev_t dev)
+{
+	struct copyfile_fs *fs;
+	unsigned i;
+
+	for (i = 0; i < MIN(s->nfs, COPYFILE_FS_CACHE); i++)
+	if (s->fs[i].dev == dev)
+		return &s->fs[i];
+
+	fs = &s->fs[s->nfs++ % COPYFILE_FS_CACHE];
+	memset(fs, 0, sizeof *fs);
+	fs->dev = dev;
+
+	return fs;
+}
+
+/*
+* Make sure the state's buffer can hold at least len bytes.
+*/
+static int copyfile_buf(copyfile_state_t s, size_t len)
+{
+	if (s->buflen >= len)
+		return 0;
+
+	free(s->buf);
+	s->buflen = 0;
+	if ((s->buf = copyfile_buf_alloc(len)) == NULL)
+		return -1;
+	s->buflen = len;
+
+	return 0;
+}
+
 /*
 * fcopyfile() is used to copy a source file descriptor to a destination file
 * descriptor.  This allows an application to figure out how it wants to open
@@ -104,7 +452,7 @@ do { \
 */
 int fcopyfile(int src_fd, int dst_fd, copyfile_state_t state, copyfile_flags_t flags)
 {
-	int ret = 0;
+	int ret = 0, writable = 0;
 	copyfile_state_t s = state;
 	struct stat dst_sb;
 
@@ -134,23 +482,66 @@ int fcopyfile(int src_fd, int dst_fd, copyfile_state_t state, copyfile_flags_t f
 		break;
 	default:
 		errno = ENOTSUP;
-		return -1;
+		ret = -1;
+		goto exit;
 	}
 
 	copyfile_debug(2, "set dst_fd <- %d", dst_fd);
 	if (s->dst_fd == -2 && dst_fd > -1)
 	s->dst_fd = dst_fd;
 
-	(void)fstat(s->dst_fd, &dst_sb);
+	/* copyfile_data() and copyfile_stat() needn't look again */
+	if ((s->dst_sb_ok = fstat(s->dst_fd, &dst_sb) == 0))
+		s->dst_sb = dst_sb;
+
+	/*
+	* All there is to copy to a socket is a file's data: it has no
+	* metadata, nor does it make sense to send it a tree, and what's been
+	* sent can't be read back to verify it.
+	*/
+	if ((s->sock = s->dst_sb_ok && S_ISSOCK(dst_sb.st_mode)))
+	{
+	if (!S_ISREG(s->sb.st_mode))
+	{
+		errno = ENOTSUP;
+		ret = -1;
+		goto exit;
+	}
+	flags &= ~(COPYFILE_XATTR | COPYFILE_STAT | COPYFILE_RECURSIVE | COPYFILE_VERIFY);
+	s->flags = flags;
+	}
+
+	/* nothing at all to do if the destination is already up to date */
+	if (copyfile_uptodate(s))
+		goto exit;
+
+	/*
+	* nor is there anything to put back if it was readable and writable
+	* already, or if there's no telling what its mode was
+	*/
+	if (s->sock || !s->dst_sb_ok || (dst_sb.st_mode & (S_IRUSR | S_IWUSR)) == (S_IRUSR | S_IWUSR))
+		writable = 1;
+	else
+	{
 	(void)fchmod(s->dst_fd, (dst_sb.st_mode & ~S_IFMT) | (S_IRUSR | S_IWUSR));
+	s->dst_sb.st_mode |= S_IRUSR | S_IWUSR;
+	}
+
+	if ((flags & COPYFILE_RECURSIVE) && S_ISDIR(s->sb.st_mode))
+	ret = copyfile_tree(s);
 
+	if (ret == 0)
 	ret = copyfile_internal(s, flags);
 
-	if (ret >= 0 && !(s->flags & COPYFILE_STAT))
+	if (ret >= 0 && !(s->flags & COPYFILE_STAT) && !writable)
 	{
 	(void)fchmod(s->dst_fd, dst_sb.st_mode & ~S_IFMT);
 	}
 
+	if (copyfile_sync_flush(s) < 0)
+	ret = -1;
+
+exit:
 	if (state == NULL)
 	copyfile_state_free(s);
 
@@ -165,6 +556,17 @@ int fcopyfile(int src_fd, int dst_fd, copyfile_state_t state, copyfile_flags_t f
 * Oh, if only life were that simple!
 */
 int copyfile(const char *src, const char *dst, copyfile_state_t state, copyfile_flags_t flags)
+{
+	return copyfileat(AT_FDCWD, src, AT_FDCWD, dst, state, flags);
+}
+
+/*
+* copyfile(), with relative names looked up from src_dirfd and dst_dirfd
+* rather than the current directory, in the manner of openat(2).  That's
+* all copyfile() does anyway: everything from then on, trees included,
+* works relative to directory descriptors already.
+*/
+int copyfileat(int src_dirfd, const char *src, int dst_dirfd, const char *dst, copyfile_state_t state, copyfile_flags_t flags)
 {
 	int ret = 0;
 	copyfile_state_t s = state;
@@ -188,12 +590,14 @@ int copyfile(const char *src, const char *dst, copyfile_state_t state, copyfile_
 * filename (e.g., src) is set, and state->src is not equal to that, then
 * we need to check to see if the file descriptor had been opened, and if so,
 * close it.  After that, we set state->src to be a copy of the given filename,
-* releasing the old copy if necessary.
+* in the buffer the state keeps for it.  The same name relative to another
+* directory is another file, too.
 */
 #define COPYFILE_SET_FNAME(NAME, S) \
 do { \
 	if (NAME != NULL) {									\
-	if (S->NAME != NULL && strncmp(NAME, S->NAME, MAXPATHLEN)) {			\
+	if (S->NAME != NULL && (NAME##_dirfd != S->NAME##_dirfd ||			\
+	    strncmp(NAME, S->NAME, MAXPATHLEN))) {						\
 		copyfile_debug(2, "replacing string %s (%s) -> (%s)", #NAME, NAME, S->NAME);\
 		if (S->NAME##_fd != -2 && S->NAME##_fd > -1) {				\
 		copyfile_debug(4, "closing %s fd: %d", #NAME, S->NAME##_fd);		\
@@ -201,34 +605,263 @@ do { \
 		S->NAME##_fd = -2;							\
 		}										\
 	}										\
-	if (S->NAME) {									\
-		free(S->NAME);								\
-		S->NAME = NULL;								\
-	}										\
-	if ((S->NAME = strdup(NAME)) == NULL)						\
+	if (copyfile_name(&S->NAME, &S->NAME##buf, &S->NAME##buflen, NAME) < 0)	\
 		return -1;									\
+	S->NAME##_dirfd = NAME##_dirfd;							\
 	}											\
 } while (0)
 
 	COPYFILE_SET_FNAME(src, s);
 	COPYFILE_SET_FNAME(dst, s);
 
+	ret = copyfile_run(s);
+
+	/* COPYFILE_DURABILITY_GROUP's fsync()s are all done here */
+	if (copyfile_sync_flush(s) < 0)
+	ret = -1;
+
+	if (state == NULL)
+	copyfile_state_free(s);
+
+	return ret;
+}
+
+/*
+* Copy s->src to s->dst, once the names are set: open them (unless
+* COPYFILE_MOVE gets away with renaming the source), then descend if
+* COPYFILE_RECURSIVE says to, and copy what the flags ask for.
+*/
+static int copyfile_run(copyfile_state_t s)
+{
+	struct stat sb;
+	int ret;
 
+	/*
+	* A move within a filesystem is just a rename, whatever the size,
+	* as long as that leaves the same thing behind as copying would:
+	* not for symlinks COPYFILE_NOFOLLOW_SRC doesn't ask us to keep, nor
+	* directories not copied with their contents.
+	*/
+	if (copyfile_can_move(s) &&
+	    s->src != NULL && s->dst != NULL && s->src_fd == -2 && s->dst_fd == -2 &&
+	    (copyfile_syscall(s), fstatat(s->src_dirfd, s->src, &sb, AT_SYMLINK_NOFOLLOW)) == 0 &&
+	    (!S_ISLNK(sb.st_mode) || (s->flags & COPYFILE_NOFOLLOW_SRC)) &&
+	    (!S_ISDIR(sb.st_mode) || (s->flags & COPYFILE_RECURSIVE)) &&
+	    (ret = copyfile_move(s, s->src_dirfd, s->src, s->dst_dirfd, s->dst)) <= 0)
+		return ret < 0 ? -1 : copyfile_sync_parent(s);
 
 	if ((ret = copyfile_open(s)) < 0)
-	goto error_exit;
+		return -1;
 
-	ret = copyfile_internal(s, flags);
+	/* ret > 0 means it was a symlink, already copied */
+	if (ret == 0)
+	{
+	if ((s->flags & COPYFILE_RECURSIVE) && S_ISDIR(s->sb.st_mode) &&
+	    (ret = copyfile_tree(s)) < 0)
+		return -1;
+
+	if ((ret = copyfile_internal(s, s->flags)) < 0)
+		return -1;
+	}
+
+	/* as with remove(3), which is all COPYFILE_MOVE does otherwise */
+	if ((s->flags & COPYFILE_MOVE) && s->src != NULL)
+	{
+	copyfile_syscall(s);
+	if (copyfile_remove(s->src_dirfd, s->src) < 0)
+		copyfile_debug(2, "cannot remove %s: %s", s->src, strerror(errno));
+	}
+
+	return copyfile_sync_parent(s);
+}
+
+/*
+* Run a single copy of a batch with s, borrowing the names from the pair
+* rather than copying them into the state.
+*/
+static int copyfile_batch_one(copyfile_state_t s, const struct copyfile_pair *pair)
+{
+	int ret;
+
+	s->src = (char *)pair->src;
+	s->dst = (char *)pair->dst;
+	s->src_fd = s->dst_fd = -2;
+	s->src_dirfd = s->dst_dirfd = AT_FDCWD;
+
+	ret = copyfile_run(s);
+
+	if (s->src_fd >= 0)
+		close(s->src_fd);
+	if (s->dst_fd >= 0 && close(s->dst_fd) < 0)
+		ret = -1;
+
+	s->src = s->dst = NULL;
+	s->src_fd = s->dst_fd = -2;
+	return ret;
+}
+
+/*
+* When a batch is split across threads, each of them takes the next pair
+* nobody has started on yet, and copies it with its own state.
+*/
+struct copyfile_batch
+{
+	const struct copyfile_pair *pairs;
+	size_t n;
+	int *results;
+	pthread_mutex_t lock;
+	size_t next;
+	int error;
+};
+
+struct copyfile_batch_worker
+{
+	struct copyfile_batch *b;
+	copyfile_state_t ws;
+	pthread_t thread;
+};
+
+static void *copyfile_batch_worker(void *arg)
+{
+	struct copyfile_batch_worker *w = arg;
+	struct copyfile_batch *b = w->b;
+	size_t i;
+	int err;
+
+	for (;;)
+	{
+	pthread_mutex_lock(&b->lock);
+	i = b->next++;
+	pthread_mutex_unlock(&b->lock);
+
+	if (i >= b->n)
+		break;
+
+	err = copyfile_batch_one(w->ws, &b->pairs[i]) < 0 ? (errno ? errno : EIO) : 0;
+
+	if (b->results != NULL)
+		b->results[i] = err;
+
+	if (err != 0)
+	{
+		pthread_mutex_lock(&b->lock);
+		if (b->error == 0)
+			b->error = err;
+		pthread_mutex_unlock(&b->lock);
+	}
+	}
+
+	/* each thread fsync()s what it copied, at the same time as the others */
+	if (copyfile_sync_flush(w->ws) < 0)
+	{
+	err = errno;
+	pthread_mutex_lock(&b->lock);
+	if (b->error == 0)
+		b->error = err;
+	pthread_mutex_unlock(&b->lock);
+	}
+
+	return NULL;
+}
+
+/*
+* copyfile_batch() copies each pair in turn with the same state, so its
+* buffer (and everything else) is reused from one to the next, and nothing
+* is allocated per pair.  A failure is recorded in results (if given) and
+* doesn't stop the others from being copied.  With COPYFILE_STATE_THREADS,
+* the pairs are spread across threads, each with its own state.
+*/
+int copyfile_batch(const struct copyfile_pair *pairs, size_t n, copyfile_state_t state, copyfile_flags_t flags, int *results)
+{
+	struct copyfile_batch b;
+	struct copyfile_batch_worker *workers = NULL;
+	copyfile_state_t s = state;
+	unsigned nworkers, i, nstarted = 0;
+	long ncpu;
+
+	if (pairs == NULL && n > 0)
+	{
+	errno = EINVAL;
+	return -1;
+	}
+
+	if (copyfile_preamble(&s, flags) < 0)
+	return -1;
+
+	/* the state's own names (and descriptors) are of no use here */
+	if (copyfile_close(s) < 0)
+	copyfile_warn("error closing files");
+	s->src = s->dst = NULL;
+	s->src_fd = s->dst_fd = -2;
+
+	memset(&b, 0, sizeof b);
+	b.pairs = pairs;
+	b.n = n;
+	b.results = results;
+	pthread_mutex_init(&b.lock, NULL);
+
+	nworkers = s->nthreads;
+	if (nworkers == 0)
+	nworkers = (ncpu = sysconf(_SC_NPROCESSORS_ONLN)) > 0 ? (unsigned)ncpu : 1;
+	if (nworkers > n)
+	nworkers = n;
+
+	if (nworkers > 1 && (workers = calloc(nworkers, sizeof *workers)) != NULL)
+	{
+	/* if some threads can't be started, there's just fewer of them */
+	for (nstarted = 0; nstarted < nworkers; nstarted++)
+	{
+		workers[nstarted].b = &b;
+		if ((workers[nstarted].ws = copyfile_state_child(s)) == NULL)
+			break;
+		if (pthread_create(&workers[nstarted].thread, NULL,
+		    copyfile_batch_worker, &workers[nstarted]) != 0)
+		{
+			copyfile_state_free(workers[nstarted].ws);
+			break;
+		}
+	}
+	}
+
+	/*
+	* The calling thread always helps out, with the caller's state; like
+	* the other threads', it copies directories in the batch by itself.
+	*/
+	{
+	struct copyfile_batch_worker self;
+	unsigned nthreads = s->nthreads;
+
+	if (nstarted > 0)
+		s->nthreads = 1;
+
+	self.b = &b;
+	self.ws = s;
+	copyfile_batch_worker(&self);
+
+	s->nthreads = nthreads;
+	}
+
+	for (i = 0; i < nstarted; i++)
+	{
+	pthread_join(workers[i].thread, NULL);
+	copyfile_stats_add(&s->stats, &workers[i].ws->stats);
+	s->tb_syscalls += workers[i].ws->stats.syscalls;
+	copyfile_state_free(workers[i].ws);
+	}
+
+	free(workers);
+	pthread_mutex_destroy(&b.lock);
 
-exit:
 	if (state == NULL)
 	copyfile_state_free(s);
 
-	return ret;
+	if (b.error != 0)
+	{
+	errno = b.error;
+	return -1;
+	}
 
-error_exit:
-	ret = -1;
-	goto exit;
+	return 0;
 }
 
 /*
@@ -247,6 +880,9 @@ static int copyfile_preamble(copyfile_state_t *state, copyfile_flags_t flags)
 	}
 
 	s = *state;
+	s->sock = 0;
+	s->created = 0;
+	s->dst_sb_ok = 0;
 
 	if (COPYFILE_DEBUG & flags)
 	{
@@ -284,6 +920,7 @@ static int copyfile_preamble(copyfile_state_t *state, copyfile_flags_t flags)
 */
 static int copyfile_internal(copyfile_state_t s, copyfile_flags_t flags)
 {
+	uint64_t start;
 	int ret = 0;
 
 	if (s->dst_fd < 0 || s->src_fd < 0)
@@ -294,17 +931,56 @@ static int copyfile_internal(copyfile_state_t s, copyfile_flags_t flags)
 	return -1;
 	}
 
+	s->cloned = 0;
+
+	if (s->uptodate)
+	{
+	copyfile_debug(2, "%s is up to date", s->dst);
+	goto exit;
+	}
+
+	/*
+	* This tells us whether or not to copy the extended attributes,
+	* which goes first so that the file's flags (copied with the rest
+	* of the POSIX information) can't get in the way.
+	*/
+	if (COPYFILE_XATTR & flags)
+	{
+	COPYFILE_XATTR_START(copyfile_probe_path(s->src), copyfile_probe_path(s->dst));
+	ret = copyfile_xattr(s);
+	COPYFILE_XATTR_DONE(copyfile_probe_path(s->src), copyfile_probe_path(s->dst), ret);
+
+	if (ret < 0)
+	{
+		copyfile_warn("error processing extended attributes");
+		goto exit;
+	}
+	}
+
 	/*
 	* Similar to above, this tells us whether or not to copy
 	* the non-meta data portion of the file.  We attempt to
 	* remove (via unlink) the destination file if we fail.
+	* Directories have no data of their own.
 	*/
-	if (COPYFILE_DATA & flags)
+	if ((COPYFILE_DATA & flags) && !S_ISDIR(s->sb.st_mode))
 	{
-	if ((ret = copyfile_data(s)) < 0)
+	COPYFILE_DATA_START(copyfile_probe_path(s->src), copyfile_probe_path(s->dst),
+	    (long long)s->sb.st_size);
+	start = copyfile_now();
+	ret = copyfile_data(s);
+	s->stats.data_ns += copyfile_now() - start;
+	COPYFILE_DATA_DONE(copyfile_probe_path(s->src), copyfile_probe_path(s->dst),
+	    (long long)s->copied, ret);
+
+	if (ret < 0)
 	{
-		copyfile_warn("error processing data");
-		if (s->dst && unlink(s->dst))
+		/* a non-blocking socket filling up is for the caller to wait out */
+		if (!s->sock || errno != EAGAIN)
+			copyfile_warn("error processing data");
+		/* what COPYFILE_RESUME got to is for the next copy to pick up */
+		if (s->dst && s->tmp == NULL && !(s->flags & COPYFILE_RESUME) &&
+		    unlinkat(s->dst_dirfd, s->dst, 0))
 			copyfile_warn("%s: remove", s->src);
 		goto exit;
 	}
@@ -312,14 +988,47 @@ static int copyfile_internal(copyfile_state_t s, copyfile_flags_t flags)
 
 	if (COPYFILE_STAT & flags)
 	{
-	if ((ret = copyfile_stat(s)) < 0)
+	COPYFILE_STAT_START(copyfile_probe_path(s->src), copyfile_probe_path(s->dst));
+	start = copyfile_now();
+	ret = copyfile_stat(s);
+	s->stats.stat_ns += copyfile_now() - start;
+	COPYFILE_STAT_DONE(copyfile_probe_path(s->src), copyfile_probe_path(s->dst), ret);
+
+	if (ret < 0)
 	{
 		copyfile_warn("error processing POSIX information");
 		goto exit;
 	}
 	}
 
+	/* a directory's entries are all in by the time it gets here */
+	if (s->durability != COPYFILE_DURABILITY_NONE && !s->sock && copyfile_sync(s, s->dst_fd, 0) < 0)
+	{
+	copyfile_warn("fsync on %s", s->dst);
+	ret = -1;
+	goto exit;
+	}
+
+	if (!S_ISDIR(s->sb.st_mode))
+	s->stats.files++;
+
 exit:
+	if (s->tmp != NULL)
+	{
+	if (ret >= 0 && copyfile_atomic_commit(s) < 0)
+	{
+		copyfile_warn("rename %s to %s", s->tmp, s->dst);
+		ret = -1;
+	}
+	if (ret < 0)
+		(void)unlinkat(s->dst_dirfd, s->tmp, 0);
+	free(s->tmp);
+	s->tmp = NULL;
+	}
+
+	/* and between files, for all they took besides their data */
+	copyfile_throttle_charge(s, 0);
+
 	return ret;
 }
 
@@ -334,6 +1043,15 @@ copyfile_state_t copyfile_state_alloc(void)
 	{
 	s->src_fd = -2;
 	s->dst_fd = -2;
+	s->src_dirfd = AT_FDCWD;
+	s->dst_dirfd = AT_FDCWD;
+	s->prealloc = 1;
+	s->nthreads = 1;
+	s->chunk_threshold = COPYFILE_CHUNK_THRESHOLD;
+	s->chunk_size = COPYFILE_CHUNK_SIZE;
+	s->progress_interval = COPYFILE_PROGRESS_INTERVAL;
+	pthread_mutex_init(&s->throttle.lock, NULL);
+	s->tb = &s->throttle;
 	} else
 	errno = ENOMEM;
 
@@ -354,15 +1072,69 @@ int copyfile_state_free(copyfile_state_t s)
 		copyfile_warn("error closing files");
 		return -1;
 	}
-	if (s->dst)
-		free(s->dst);
-	if (s->src)
-		free(s->src);
+	free(s->dstbuf);
+	free(s->srcbuf);
+	free(s->buf);
+	free(s->xbuf);
+	while (s->nsync > 0)
+		close(s->syncfds[--s->nsync]);
+	free(s->syncfds);
+	free(s->tmp);
+	free(s->manifest);
+	pthread_mutex_destroy(&s->throttle.lock);
 	free(s);
 	}
 	return 0;
 }
 
+/*
+* copyfile_state_reset() readies the state for another copy, as though
+* it were new, except that it keeps the settings it was given along
+* with its buffers and what it's learnt about filesystems, so that a
+* caller copying file after file with it needn't allocate anything.
+* It closes the file descriptors if they've been opened, same as
+* copyfile_state_free(), and fsync()s whatever COPYFILE_DURABILITY_GROUP
+* still has outstanding.
+*/
+int copyfile_state_reset(copyfile_state_t s)
+{
+	int ret = 0;
+
+	if (s == NULL)
+	{
+	errno = EINVAL;
+	return -1;
+	}
+
+	if (copyfile_sync_flush(s) < 0)
+	ret = -1;
+
+	if (copyfile_close(s) < 0)
+	{
+	copyfile_warn("error closing files");
+	ret = -1;
+	}
+
+	s->src = s->dst = NULL;
+	s->src_fd = s->dst_fd = -2;
+	s->src_dirfd = s->dst_dirfd = AT_FDCWD;
+	s->sock = s->created = s->dst_sb_ok = 0;
+	memset(&s->sb, 0, sizeof s->sb);
+	memset(&s->stats, 0, sizeof s->stats);
+	s->tb_syscalls = 0;
+	s->copied = s->progress_next = 0;
+	s->hashing = 0;
+	s->crc = s->digest = 0;
+	s->cloned = s->uptodate = 0;
+	s->noxdev = 0;
+	free(s->tmp);
+	s->tmp = NULL;
+	s->direct = 0;
+	s->dropped = 0;
+
+	return ret;
+}
+
 /*
 * Should we worry if we can't close the source?  NFS says we
 * should, but it's pretty late for us at this point.
@@ -380,24 +1152,396 @@ static int copyfile_close(copyfile_state_t s)
 	return 0;
 }
 
+/*
+* Like remove(3), but relative to a directory descriptor.
+*/
+static int copyfile_remove(int dirfd, const char *name)
+{
+	if (unlinkat(dirfd, name, 0) == 0)
+		return 0;
+
+	if (errno != EPERM && errno != EISDIR)
+		return -1;
+
+	return unlinkat(dirfd, name, AT_REMOVEDIR);
+}
+
+/*
+* COPYFILE_MOVE's fast path: rename src to dst.  Returns 1 if the copy
+* has to happen after all -- because they're on different filesystems,
+* which is remembered so the rest of a tree doesn't try again, or dst is
+* a directory which isn't empty, to be merged into.  With COPYFILE_EXCL,
+* an existing dst fails here as it would when copying: anything but a
+* directory is linked to its new name and then unlinked from its old one,
+* since rename(2) would replace whatever got there first, and otherwise
+* only a dst that's there beforehand can be caught.
+*/
+static int copyfile_move(copyfile_state_t s, int src_dirfd, const char *src, int dst_dirfd, const char *dst)
+{
+	struct stat sb;
+
+	if (s->flags & COPYFILE_EXCL)
+	{
+	copyfile_syscall(s);
+	if (linkat(src_dirfd, src, dst_dirfd, dst, 0) == 0)
+	{
+		copyfile_syscall(s);
+		if (unlinkat(src_dirfd, src, 0) < 0)
+		{
+			copyfile_warn("%s: remove", src);
+			(void)unlinkat(dst_dirfd, dst, 0);
+			return -1;
+		}
+		goto renamed;
+	}
+
+	/* directories, and filesystems without hard links, say EPERM or EOPNOTSUPP */
+	if (errno != EEXIST && errno != EXDEV &&
+	    (copyfile_syscall(s), fstatat(dst_dirfd, dst, &sb, AT_SYMLINK_NOFOLLOW)) == 0)
+		errno = EEXIST;
+
+	if (errno == EEXIST)
+	{
+		copyfile_warn("%s", dst);
+		return -1;
+	}
+
+	if (errno == EXDEV)
+		goto copy;
+	}
+
+	copyfile_syscall(s);
+	if (renameat(src_dirfd, src, dst_dirfd, dst) < 0)
+	{
+	/* nothing but having to copy or merge it is worth trying the copy for */
+	if (errno != EXDEV && errno != ENOTEMPTY && errno != EEXIST && errno != EISDIR)
+	{
+		copyfile_warn("rename %s to %s", src, dst);
+		return -1;
+	}
+	goto copy;
+	}
+
+renamed:
+	copyfile_debug(3, "renamed %s to %s", src, dst);
+	s->stats.renames++;
+	return 0;
+
+copy:
+	copyfile_debug(2, "cannot rename %s to %s (%s), copying it", src, dst, strerror(errno));
+	if (errno == EXDEV)
+		s->noxdev = 1;
+
+	return 1;
+}
+
+/*
+* Make what fd refers to durable, as COPYFILE_STATE_DURABILITY says.
+* COPYFILE_DURABILITY_GROUP holds on to a descriptor of its own for
+* copyfile_sync_flush() (taking fd itself if we own it), unless it can't
+* spare one, in which case it's fsync()ed at once.
+*/
+static int copyfile_sync(copyfile_state_t s, int fd, int own)
+{
+	int ret = 0, kept;
+
+	if (s->durability == COPYFILE_DURABILITY_GROUP)
+	{
+	if (s->nsync == COPYFILE_SYNC_GROUP && copyfile_sync_flush(s) < 0)
+		ret = -1;
+
+	if (s->syncfds == NULL)
+		s->syncfds = malloc(COPYFILE_SYNC_GROUP * sizeof *s->syncfds);
+
+	if (s->syncfds != NULL && (kept = own ? fd : (copyfile_syscall(s), dup(fd))) >= 0)
+	{
+		s->syncfds[s->nsync++] = kept;
+		return ret;
+	}
+	}
+
+	if (s->durability != COPYFILE_DURABILITY_NONE &&
+	    (copyfile_syscall(s), fsync(fd)) < 0)
+		ret = -1;
+
+	if (own)
+		close(fd);
+	return ret;
+}
+
+/*
+* fsync() everything COPYFILE_DURABILITY_GROUP has been holding on to,
+* one straight after the other.
+*/
+static int copyfile_sync_flush(copyfile_state_t s)
+{
+	int err = 0;
+
+	while (s->nsync > 0)
+	{
+	copyfile_syscall(s);
+	if (fsync(s->syncfds[--s->nsync]) < 0 && err == 0)
+		err = errno;
+	close(s->syncfds[s->nsync]);
+	}
+
+	if (err != 0)
+	{
+	errno = err;
+	copyfile_warn("fsync");
+	return -1;
+	}
+
+	return 0;
+}
+
+/*
+* The destination's own directory entry is only durable once the
+* directory it's in is too.
+*/
+static int copyfile_sync_parent(copyfile_state_t s)
+{
+	char dir[MAXPATHLEN];
+	const char *slash;
+	size_t len;
+	int fd;
+
+	if (s->durability == COPYFILE_DURABILITY_NONE || s->dst == NULL)
+		return 0;
+
+	if ((slash = strrchr(s->dst, '/')) == NULL)
+		strcpy(dir, ".");
+	else if ((len = (size_t)(slash - s->dst)) == 0)
+		strcpy(dir, "/");
+	else if (len < sizeof dir)
+	{
+		memcpy(dir, s->dst, len);
+		dir[len] = '\0';
+	}
+	else
+	{
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+
+	copyfile_syscall(s);
+	if ((fd = openat(s->dst_dirfd, dir, O_RDONLY | O_DIRECTORY)) < 0 ||
+	    copyfile_sync(s, fd, 1) < 0)
+	{
+	copyfile_warn("fsync on %s", dir);
+	return -1;
+	}
+
+	return 0;
+}
+
+/*
+* Read through both files and see if they're the same, two halves of the
+* state's buffer at a time.
+*/
+static int copyfile_same_data(copyfile_state_t s, int dst_fd)
+{
+	off_t off = 0;
+	ssize_t nsrc, ndst;
+	size_t half;
+
+	if (copyfile_buf(s, 2 * COPYFILE_COMPARE_BLOCK) < 0)
+		return 0;
+	half = s->buflen / 2;
+
+	while ((copyfile_syscall(s), nsrc = pread(s->src_fd, s->buf, half, off)) > 0)
+	{
+	copyfile_syscall(s);
+	ndst = pread(dst_fd, s->buf + half, (size_t)nsrc, off);
+	if (ndst != nsrc || memcmp(s->buf, s->buf + half, (size_t)nsrc) != 0)
+		return 0;
+	off += nsrc;
+	}
+
+	return nsrc == 0 && off == s->sb.st_size;
+}
+
+/*
+* COPYFILE_UPDATE: a regular destination with the same size and (to the
+* second, which is all copyfile_stat() sets) modification time as the
+* source is taken to be a copy of it already -- and, if asked to with
+* COPYFILE_STATE_UPDATE_COMPARE, to have the same data too.  If so, it
+* is left alone, opened read-only if it wasn't open yet so that the rest
+* of the copy goes through the motions without touching it.  Anything
+* going wrong here merely means the file gets copied.
+*/
+static int copyfile_uptodate(copyfile_state_t s)
+{
+	struct stat dst_sb;
+	int dst_fd = s->dst_fd;
+
+	s->uptodate = 0;
+
+	if (!(s->flags & COPYFILE_UPDATE) || !S_ISREG(s->sb.st_mode))
+		return 0;
+
+	copyfile_syscall(s);
+	if (dst_fd >= 0 ? fstat(dst_fd, &dst_sb) < 0 :
+	    s->dst == NULL || fstatat(s->dst_dirfd, s->dst, &dst_sb,
+	    (s->flags & COPYFILE_NOFOLLOW_DST) ? AT_SYMLINK_NOFOLLOW : 0) < 0)
+		return 0;
+
+	if (!S_ISREG(dst_sb.st_mode) || dst_sb.st_size != s->sb.st_size ||
+	    dst_sb.st_mtime != s->sb.st_mtime)
+		return 0;
+
+	if (dst_fd < 0 && (copyfile_syscall(s), dst_fd = openat(s->dst_dirfd, s->dst,
+	    O_RDONLY | ((s->flags & COPYFILE_NOFOLLOW_DST) ? O_NOFOLLOW : 0))) < 0)
+		return 0;
+
+	if (s->update_compare && !copyfile_same_data(s, dst_fd))
+	{
+		if (dst_fd != s->dst_fd)
+			(void)close(dst_fd);
+		return 0;
+	}
+
+	s->dst_fd = dst_fd;
+	s->uptodate = 1;
+	s->stats.uptodate++;
+
+	return 1;
+}
+
+/*
+* COPYFILE_ATOMIC: create the file the destination is written to in the
+* directory it's going into, hidden as ".<name>.XXXXXX", so that it can
+* be renamed over it once complete.  With COPYFILE_EXCL, there's no point
+* copying anything if dst is already there.
+*/
+static int copyfile_atomic_open(copyfile_state_t s, int oflags)
+{
+	const char *base;
+	struct stat sb;
+	size_t dirlen, baselen, len;
+	int tries;
+
+	if (s->flags & COPYFILE_EXCL)
+	{
+	copyfile_syscall(s);
+	if (fstatat(s->dst_dirfd, s->dst, &sb, AT_SYMLINK_NOFOLLOW) == 0)
+	{
+		errno = EEXIST;
+		copyfile_warn("open on %s", s->dst);
+		return -1;
+	}
+	}
+
+	base = strrchr(s->dst, '/');
+	base = base == NULL ? s->dst : base + 1;
+	dirlen = (size_t)(base - s->dst);
+
+	/* leave room for the dots and the suffix */
+	baselen = MIN(strlen(base), NAME_MAX - 8);
+
+	len = dirlen + baselen + 9;
+	if ((s->tmp = malloc(len)) == NULL)
+		return -1;
+
+	for (tries = 0; ; tries++)
+	{
+	snprintf(s->tmp, len, "%.*s.%.*s.%06x", (int)dirlen, s->dst,
+	    (int)baselen, base, arc4random() & 0xffffff);
+
+	copyfile_syscall(s);
+	if ((s->dst_fd = openat(s->dst_dirfd, s->tmp, oflags | O_CREAT | O_EXCL,
+	    s->sb.st_mode | S_IWUSR)) >= 0)
+	{
+		copyfile_debug(3, "writing %s as %s", s->dst, s->tmp);
+		return 0;
+	}
+
+	if (errno != EEXIST || tries == 100)
+		break;
+	}
+
+	copyfile_warn("open on %s", s->tmp);
+	free(s->tmp);
+	s->tmp = NULL;
+	return -1;
+}
+
+/*
+* Put the complete temporary file in place of the destination.  link(2),
+* unlike rename(2), won't replace anything, for COPYFILE_EXCL.
+*/
+static int copyfile_atomic_commit(copyfile_state_t s)
+{
+	copyfile_syscall(s);
+	if (!(s->flags & COPYFILE_EXCL))
+		return renameat(s->dst_dirfd, s->tmp, s->dst_dirfd, s->dst);
+
+	if (linkat(s->dst_dirfd, s->tmp, s->dst_dirfd, s->dst, 0) < 0)
+		return -1;
+
+	copyfile_syscall(s);
+	(void)unlinkat(s->dst_dirfd, s->tmp, 0);
+	return 0;
+}
+
 /*
 * copyfile_open() does what one expects:  it opens up the files
 * given in the state structure, if they're not already open.
 * It also does some type validation, to ensure that we only
-* handle file types we know about.
+* handle file types we know about.  With COPYFILE_NOFOLLOW_SRC, a source
+* which is a symlink is recreated as one instead, and 1 returned since
+* there's nothing left to copy.
 */
+static int copyfile_open_files(copyfile_state_t s);
+static int copyfile_symlink(copyfile_state_t s, int src_dirfd, const char *src, int dst_dirfd, const char *dst);
+
 static int copyfile_open(copyfile_state_t s)
 {
-	int oflags = O_EXCL | O_CREAT | O_WRONLY;
-	int isdir = 0;
+	uint64_t start = copyfile_now();
+	int ret;
+
+	COPYFILE_OPEN_START(copyfile_probe_path(s->src), copyfile_probe_path(s->dst));
+	ret = copyfile_open_files(s);
+	s->stats.open_ns += copyfile_now() - start;
+	COPYFILE_OPEN_DONE(copyfile_probe_path(s->src), copyfile_probe_path(s->dst), ret);
+
+	return ret;
+}
+
+static int copyfile_open_files(copyfile_state_t s)
+{
+	/* COPYFILE_DATA_DELTA, COPYFILE_RESUME and COPYFILE_VERIFY read the destination back */
+	int oflags = O_EXCL | O_CREAT |
+	    ((s->flags & (COPYFILE_DATA_DELTA | COPYFILE_RESUME | COPYFILE_VERIFY)) ? O_RDWR : O_WRONLY);
+	int isdir = 0, atomic;
 	int osrc = 0, dsrc = 0;
 
 	if (s->src && s->src_fd == -2)
 	{
-		// on macOS, depending on if the the COPYFILE_NOFOLLOW_SRC flag is set, either lstatx_np or statx_np is called
-		// but aquaBSD doesn't have such functions in its standard library, so I'll have to come back to this and rewrite copyfile_open "properly"
+		if (s->flags & COPYFILE_NOFOLLOW_SRC)
+			osrc = O_NOFOLLOW;
+
+		/*
+		* Open first and look at what we got, so that the name is only
+		* resolved once and it can't be swapped for something else in
+		* between.  O_NONBLOCK keeps a FIFO from hanging us before we get
+		* to turn it down; it means nothing to files and directories.
+		*/
+		copyfile_syscall(s);
+		if ((s->src_fd = openat(s->src_dirfd, s->src, O_RDONLY | O_NONBLOCK | O_NOCTTY | osrc, 0)) < 0)
+		{
+			/* FreeBSD says EMLINK when O_NOFOLLOW finds a symlink, others ELOOP */
+			if (osrc && (errno == EMLINK || errno == ELOOP))
+			{
+				s->src_fd = -2;
+				return copyfile_symlink(s, s->src_dirfd, s->src, s->dst_dirfd, s->dst) < 0 ? -1 : 1;
+			}
+			copyfile_warn("open on %s", s->src);
+			return -1;
+		}
 
-		if (stat(s->src, &s->sb) < 0) {
+		copyfile_syscall(s);
+		if (fstat(s->src_fd, &s->sb) < 0) {
 			copyfile_warn("stat on %s", s->src);
 			return -1;
 		}
@@ -411,28 +1555,33 @@ static int copyfile_open(copyfile_state_t s)
 			case S_IFREG:
 			break;
 			default:
+			close(s->src_fd);
+			s->src_fd = -2;
 			errno = ENOTSUP;
 			return -1;
 		}
 
-		if ((s->src_fd = open(s->src, O_RDONLY | osrc , 0)) < 0)
-		{
-			copyfile_warn("open on %s", s->src);
-			return -1;
-		} else
-			copyfile_debug(2, "open successful on source (%s)", s->src);
+		copyfile_debug(2, "open successful on source (%s)", s->src);
 	}
 
-	if (s->dst && s->dst_fd == -2)
+	s->created = 0;
+	s->dst_sb_ok = 0;
+
+	if (s->dst && s->dst_fd == -2 && !copyfile_uptodate(s))
 	{
+	/* COPYFILE_ATOMIC leaves dst alone until its replacement is ready */
+	atomic = !isdir && (s->flags & COPYFILE_ATOMIC);
+
 	/*
 	* COPYFILE_UNLINK tells us to try removing the destination
 	* before we create it.  We don't care if the file doesn't
-	* exist, so we ignore ENOENT.
+	* exist, so we ignore ENOENT.  COPYFILE_RESUME wants what's
+	* there.
 	*/
-	if (COPYFILE_UNLINK & s->flags)
+	if ((COPYFILE_UNLINK & s->flags) && !(COPYFILE_RESUME & s->flags) && !atomic)
 	{
-		if (remove(s->dst) < 0 && errno != ENOENT)
+		copyfile_syscall(s);
+		if (copyfile_remove(s->dst_dirfd, s->dst) < 0 && errno != ENOENT)
 		{
 		copyfile_warn("%s: remove", s->dst);
 		return -1;
@@ -446,18 +1595,28 @@ static int copyfile_open(copyfile_state_t s)
 		mode_t mode;
 		mode = s->sb.st_mode & ~S_IFMT;
 
-		if (mkdir(s->dst, mode) == -1) {
+		/* we'll need to create the children; copyfile_tree() fixes this up */
+		if (s->flags & COPYFILE_RECURSIVE)
+			mode |= S_IRWXU;
+
+		s->stats.syscalls += 2;
+		if (mkdirat(s->dst_dirfd, s->dst, mode) == -1) {
 			if (errno != EEXIST || (s->flags & COPYFILE_EXCL)) {
 				copyfile_warn("Cannot make directory %s", s->dst);
 				return -1;
 			}
-		}
-		s->dst_fd = open(s->dst, O_RDONLY | dsrc);
+		} else
+			s->created = 1;
+		s->dst_fd = openat(s->dst_dirfd, s->dst, O_RDONLY | dsrc);
 		if (s->dst_fd == -1) {
 			copyfile_warn("Cannot open directory %s for reading", s->dst);
 			return -1;
 		}
-	} else while((s->dst_fd = open(s->dst, oflags | dsrc, s->sb.st_mode | S_IWUSR)) < 0)
+	} else if (atomic) {
+		if (copyfile_atomic_open(s, oflags) < 0)
+			return -1;
+		s->created = 1;
+	} else while(copyfile_syscall(s), (s->dst_fd = openat(s->dst_dirfd, s->dst, oflags | dsrc, s->sb.st_mode | S_IWUSR)) < 0)
 	{
 		/*
 		* We set S_IWUSR because fsetxattr does not -- at the time this comment
@@ -474,7 +1633,8 @@ static int copyfile_open(copyfile_state_t s)
 			oflags = oflags & ~O_CREAT;
 			continue;
 		case EACCES:
-			if(chmod(s->dst, (s->sb.st_mode | S_IWUSR) & ~S_IFMT) == 0)
+			copyfile_syscall(s);
+			if(fchmodat(s->dst_dirfd, s->dst, (s->sb.st_mode | S_IWUSR) & ~S_IFMT, 0) == 0)
 			continue;
 			else {
 			break;
@@ -484,12 +1644,15 @@ static int copyfile_open(copyfile_state_t s)
 			if ((s->flags & COPYFILE_EXCL) ||
 			(!isdir && (s->flags & COPYFILE_DATA)))
 			break;
-			oflags = (oflags & ~O_WRONLY) | O_RDONLY;
+			oflags = (oflags & ~(O_WRONLY | O_RDWR)) | O_RDONLY;
 			continue;
 		}
 		copyfile_warn("open on %s", s->dst);
 		return -1;
 	}
+	/* O_CREAT is only given up on once the destination turns out to be there */
+	if (!isdir && !atomic)
+		s->created = (oflags & O_CREAT) != 0;
 	copyfile_debug(2, "open successful on destination (%s)", s->dst);
 	}
 
@@ -504,88 +1667,3038 @@ static int copyfile_open(copyfile_state_t s)
 }
 
 /*
-* Attempt to copy the data section of a file.  Using blockisize
-* is not necessarily the fastest -- it might be desirable to
-* specify a blocksize, somehow.  But it's a size that should be
-* guaranteed to work.
+* Recreate the symlink src as dst, replacing whatever is in its way unless
+* COPYFILE_EXCL was given.  That's how trees copy their links (we never
+* follow links inside a tree), and how COPYFILE_NOFOLLOW_SRC copies one.
 */
-static int copyfile_data(copyfile_state_t s)
+static int copyfile_symlink(copyfile_state_t s, int src_dirfd, const char *src, int dst_dirfd, const char *dst)
 {
-	size_t blen;
-	char *bp = 0;
-	ssize_t nread;
-	int ret = 0;
-	size_t iBlocksize = 0;
-	struct statfs sfs;
+	char target[MAXPATHLEN];
+	struct stat sb;
+	struct timespec times[2];
+	ssize_t len;
 
-	if (fstatfs(s->src_fd, &sfs) == -1) {
-	iBlocksize = s->sb.st_blksize;
-	} else {
-	iBlocksize = sfs.f_iosize;
+	if (fstatat(src_dirfd, src, &sb, AT_SYMLINK_NOFOLLOW) < 0 ||
+	    (len = readlinkat(src_dirfd, src, target, sizeof target)) < 0)
+	{
+	copyfile_warn("readlink on %s", src);
+	return -1;
 	}
 
-	if ((bp = malloc(iBlocksize)) == NULL)
+	if ((size_t)len >= sizeof target)
+	{
+	errno = ENAMETOOLONG;
 	return -1;
+	}
 
-	blen = iBlocksize;
+	target[len] = '\0';
 
-/* If supported, do preallocation for Xsan / HFS volumes */
-#ifdef F_PREALLOCATE
+	while (symlinkat(target, dst_dirfd, dst) < 0)
 	{
-	fstore_t fst;
-
-	fst.fst_flags = 0;
-	fst.fst_posmode = F_PEOFPOSMODE;
-	fst.fst_offset = 0;
-	fst.fst_length = s->sb.st_size;
-	/* Ignore errors; this is merely advisory. */
-	(void)fcntl(s->dst_fd, F_PREALLOCATE, &fst);
-	}
-#endif
-
-	while ((nread = read(s->src_fd, bp, blen)) > 0)
+	if (errno != EEXIST || (s->flags & COPYFILE_EXCL) ||
+	    copyfile_remove(dst_dirfd, dst) < 0)
 	{
-	size_t nwritten;
-	size_t left = nread;
-	void *ptr = bp;
-
-	while (left > 0) {
-		int loop = 0;
-		nwritten = write(s->dst_fd, ptr, left);
-		switch (nwritten) {
-		case 0:
-			if (++loop > 5) {
-				copyfile_warn("writing to output %d times resulted in 0 bytes written", loop);
-				ret = -1;
-				errno = EAGAIN;
-				goto exit;
-			}
-			break;
-		case -1:
-			copyfile_warn("writing to output file got error");
-			ret = -1;
-			goto exit;
-		default:
-			left -= nwritten;
-			ptr = ((char*)ptr) + nwritten;
-			break;
-		}
-	}
+		copyfile_warn("symlink on %s", dst);
+		return -1;
 	}
-	if (nread < 0)
-	{
-	copyfile_warn("reading from %s", s->src);
-	goto exit;
 	}
 
-	if (ftruncate(s->dst_fd, s->sb.st_size) < 0)
+	if (s->flags & COPYFILE_STAT)
 	{
-	ret = -1;
-	goto exit;
+	/* As in copyfile_stat(), none of this is fatal */
+	(void)fchownat(dst_dirfd, dst, sb.st_uid, sb.st_gid, AT_SYMLINK_NOFOLLOW);
+	(void)fchmodat(dst_dirfd, dst, sb.st_mode & ~S_IFMT, AT_SYMLINK_NOFOLLOW);
+
+	times[0] = sb.st_atim;
+	times[1] = sb.st_mtim;
+	if (utimensat(dst_dirfd, dst, times, AT_SYMLINK_NOFOLLOW))
+		copyfile_warn("%s: set times", dst);
 	}
 
-exit:
-	free(bp);
+	return 0;
+}
+
+/*
+* COPYFILE_RECURSIVE is implemented as a pool of workers (only the calling
+* thread, unless COPYFILE_STATE_THREADS says otherwise) taking entries of
+* the tree off queues and copying them, each with its own state.  Every
+* worker has its own queue, which it pushes the entries of the directories
+* it lists onto and pops from the back of, so that it goes depth-first and
+* keeps few directories open; workers with nothing left to do steal from
+* the front of the others' queues.
+*
+* A directory stays open for as long as some of its entries still have to
+* be copied, and whoever finishes the last of them also finishes the
+* directory itself, copying its metadata now that its contents won't change
+* it anymore.  With a manifest, fresh says its destination was only just
+* made, same that the source is as the manifest has it, and changed that
+* some of its entries had to be copied after all.
+*/
+struct copyfile_dir
+{
+	struct copyfile_dir *parent;
+	int src_fd;
+	int dst_fd;
+	struct stat sb;
+	unsigned refs;
+	int fresh;
+	int same;
+	int changed;
+	char name[];
+};
+
+struct copyfile_entry
+{
+	struct copyfile_dir *dir;
+	unsigned char type;
+	char name[];
+};
+
+struct copyfile_queue
+{
+	pthread_mutex_t lock;
+	struct copyfile_entry **entries;
+	size_t head;
+	size_t count;
+	size_t size;
+};
+
+/*
+* COPYFILE_STATE_MANIFEST is a header, an entry for every regular file
+* (with just the one link) and directory of the tree, sorted by path, and
+* then the paths, relative to the root and NUL-terminated.  It's in the
+* machine's own byte order, and mapped to be searched in place.  A file
+* is taken not to have changed if its size, inode, and modification and
+* change times are the same: changing its metadata changes the latter.
+*/
+#define COPYFILE_MANIFEST_MAGIC		"cfmanif"
+#define COPYFILE_MANIFEST_VERSION	1
+
+#define COPYFILE_MANIFEST_DIR	0x1	/* the entry is a directory */
+#define COPYFILE_MANIFEST_CRC	0x2	/* crc is the checksum of its data */
+
+struct copyfile_manifest_header
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t count;
+	uint64_t src_ino;	/* the roots of the tree and its copy */
+	uint64_t dst_ino;
+};
+
+struct copyfile_manifest_entry
+{
+	uint64_t path;		/* offset into the paths */
+	uint64_t size;
+	uint64_t ino;
+	int64_t mtime;
+	int64_t ctime;
+	int32_t mtime_nsec;
+	int32_t ctime_nsec;
+	uint32_t crc;
+	uint32_t flags;
+};
+
+/* an entry of the next manifest, and its path once they're all in */
+struct copyfile_record
+{
+	struct copyfile_manifest_entry e;
+	const char *name;
+};
+
+/*
+* A file with several hard links, and where the first of them to be
+* copied ended up, relative to the destination root -- followed by the
+* temporary name it's written under with COPYFILE_ATOMIC, or "".
+*/
+struct copyfile_link
+{
+	struct copyfile_link *next;
+	dev_t dev;
+	ino_t ino;
+	char path[];
+};
+
+/*
+* queued counts the entries sitting in the queues, and pending those which
+* haven't been completely copied yet; the tree is done when the latter
+* drops to zero.  error holds the errno of the first failure, after which
+* the remaining entries are just dropped.  links is a hash table, with
+* nbuckets chains holding nlinks entries all told, of the files with
+* hard links seen so far, looked up under links_lock.  manifest says
+* there's a COPYFILE_STATE_MANIFEST: map is the last one, mapped in, with
+* its mcount entries and its paths, and records the entries of the next,
+* their paths in paths, added to under manifest_lock.
+*/
+struct copyfile_tree
+{
+	copyfile_state_t s;
+	unsigned nworkers;
+	struct copyfile_queue *queues;
+	pthread_mutex_t lock;
+	pthread_cond_t wake;
+	size_t queued;
+	size_t pending;
+	int error;
+	pthread_mutex_t links_lock;
+	struct copyfile_link **links;
+	size_t nbuckets;
+	size_t nlinks;
+	int manifest;
+	void *map;
+	size_t maplen;
+	const struct copyfile_manifest_entry *mentries;
+	size_t mcount;
+	const char *mpaths;
+	size_t mpathslen;
+	pthread_mutex_t manifest_lock;
+	struct copyfile_record *records;
+	size_t nrecords;
+	size_t recordsize;
+	char *paths;
+	size_t pathslen;
+	size_t pathssize;
+};
+
+struct copyfile_worker
+{
+	struct copyfile_tree *t;
+	unsigned id;
+	copyfile_state_t ws;
+	pthread_t thread;
+};
+
+static int copyfile_tree_path(const struct copyfile_dir *d, const char *name, char *buf, size_t size);
+static int copyfile_manifest_add(struct copyfile_tree *t, const char *path, const struct stat *sb, uint32_t flags, uint32_t crc);
+
+/*
+* Set up a state for copying entries on behalf of s, carrying over the
+* settings its caller made.
+*/
+static copyfile_state_t copyfile_state_child(copyfile_state_t s)
+{
+	copyfile_state_t cs;
+
+	if ((cs = copyfile_state_alloc()) == NULL)
+		return NULL;
+
+	cs->flags = s->flags;
+	cs->debug = s->debug;
+	cs->blksize = s->blksize;
+	cs->prealloc = s->prealloc;
+	cs->engine = s->engine;
+	cs->checksum = s->checksum;
+	cs->update_compare = s->update_compare;
+	cs->noxdev = s->noxdev;
+	cs->durability = s->durability;
+	cs->chunk_threshold = s->chunk_threshold;
+	cs->chunk_size = s->chunk_size;
+	cs->progress = s->progress;
+	cs->progress_ctx = s->progress_ctx;
+	cs->progress_interval = s->progress_interval;
+	memcpy(cs->fs, s->fs, sizeof cs->fs);
+	cs->nfs = s->nfs;
+	cs->tb = s->tb;
+
+	return cs;
+}
+
+/*
+* Fold the statistics of a child state back into its parent's.
+*/
+static void copyfile_stats_add(struct copyfile_stats *dst, const struct copyfile_stats *src)
+{
+	dst->bytes += src->bytes;
+	dst->files += src->files;
+	dst->clones += src->clones;
+	dst->uptodate += src->uptodate;
+	dst->links += src->links;
+	dst->renames += src->renames;
+	dst->syscalls += src->syscalls;
+	dst->holes += src->holes;
+	dst->hole_bytes += src->hole_bytes;
+	dst->blocks_skipped += src->blocks_skipped;
+	dst->resumed += src->resumed;
+	dst->open_ns += src->open_ns;
+	dst->data_ns += src->data_ns;
+	dst->stat_ns += src->stat_ns;
+	dst->throttled_ns += src->throttled_ns;
+}
+
+static void copyfile_tree_fail(struct copyfile_tree *t)
+{
+	int err = errno ? errno : EIO;
+
+	pthread_mutex_lock(&t->lock);
+	if (t->error == 0)
+		t->error = err;
+	pthread_mutex_unlock(&t->lock);
+}
+
+/*
+* Queue up the entry called name of directory d on the queue of worker id.
+*/
+static int copyfile_tree_push(struct copyfile_tree *t, unsigned id, struct copyfile_dir *d, const char *name, unsigned char type)
+{
+	struct copyfile_queue *q = &t->queues[id];
+	struct copyfile_entry *e, **entries;
+	size_t len = strlen(name) + 1;
+	size_t i;
+
+	if ((e = malloc(sizeof *e + len)) == NULL)
+		return -1;
+
+	e->dir = d;
+	e->type = type;
+	memcpy(e->name, name, len);
+
+	pthread_mutex_lock(&t->lock);
+	d->refs++;
+	t->pending++;
+	pthread_mutex_unlock(&t->lock);
+
+	pthread_mutex_lock(&q->lock);
+	if (q->count == q->size)
+	{
+	if ((entries = malloc(MAX(q->size * 2, 64) * sizeof *entries)) == NULL)
+	{
+		pthread_mutex_unlock(&q->lock);
+		pthread_mutex_lock(&t->lock);
+		d->refs--;
+		t->pending--;
+		pthread_mutex_unlock(&t->lock);
+		free(e);
+		return -1;
+	}
+	for (i = 0; i < q->count; i++)
+		entries[i] = q->entries[(q->head + i) % q->size];
+	free(q->entries);
+	q->entries = entries;
+	q->head = 0;
+	q->size = MAX(q->size * 2, 64);
+	}
+	q->entries[(q->head + q->count++) % q->size] = e;
+	pthread_mutex_unlock(&q->lock);
+
+	pthread_mutex_lock(&t->lock);
+	t->queued++;
+	pthread_cond_signal(&t->wake);
+	pthread_mutex_unlock(&t->lock);
+
+	return 0;
+}
+
+/*
+* Get the next entry for worker id to copy: the newest one on its own
+* queue, or else the oldest one on someone else's.  Waits for more to
+* show up while other workers may still produce some, and returns NULL
+* once the whole tree is done.  *stop is set if the entry should be
+* dropped rather than copied.
+*/
+static struct copyfile_entry *copyfile_tree_pop(struct copyfile_tree *t, unsigned id, int *stop)
+{
+	struct copyfile_queue *q;
+	struct copyfile_entry *e;
+	unsigned i;
+
+	for (;;)
+	{
+	e = NULL;
+
+	q = &t->queues[id];
+	pthread_mutex_lock(&q->lock);
+	if (q->count > 0)
+		e = q->entries[(q->head + --q->count) % q->size];
+	pthread_mutex_unlock(&q->lock);
+
+	for (i = 1; e == NULL && i < t->nworkers; i++)
+	{
+		q = &t->queues[(id + i) % t->nworkers];
+		pthread_mutex_lock(&q->lock);
+		if (q->count > 0)
+		{
+		e = q->entries[q->head];
+		q->head = (q->head + 1) % q->size;
+		q->count--;
+		}
+		pthread_mutex_unlock(&q->lock);
+	}
+
+	pthread_mutex_lock(&t->lock);
+	if (e != NULL)
+	{
+		t->queued--;
+		*stop = t->error != 0;
+		pthread_mutex_unlock(&t->lock);
+		return e;
+	}
+
+	/* an entry that's been counted but not pushed yet is just retried */
+	while (t->queued == 0 && t->pending > 0)
+		pthread_cond_wait(&t->wake, &t->lock);
+
+	if (t->pending == 0)
+	{
+		pthread_mutex_unlock(&t->lock);
+		return NULL;
+	}
+	pthread_mutex_unlock(&t->lock);
+	}
+}
+
+/*
+* Queue up all the entries of directory d for worker id.
+*/
+static int copyfile_tree_list(struct copyfile_tree *t, unsigned id, struct copyfile_dir *d)
+{
+	DIR *dir;
+	struct dirent *de;
+	struct stat sb;
+	unsigned char type;
+	int fd;
+	int ret = 0;
+
+	if ((fd = dup(d->src_fd)) < 0 || (dir = fdopendir(fd)) == NULL)
+	{
+	copyfile_warn("opendir on %s", d->name);
+	if (fd >= 0)
+		close(fd);
+	return -1;
+	}
+
+	for (;;)
+	{
+	errno = 0;
+	if ((de = readdir(dir)) == NULL)
+	{
+		if (errno != 0)
+		{
+		copyfile_warn("readdir on %s", d->name);
+		ret = -1;
+		}
+		break;
+	}
+
+	if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+		continue;
+
+	type = de->d_type;
+	if (type == DT_UNKNOWN)
+	{
+		if (fstatat(d->src_fd, de->d_name, &sb, AT_SYMLINK_NOFOLLOW) < 0)
+		{
+		copyfile_warn("stat on %s", de->d_name);
+		ret = -1;
+		break;
+		}
+		type = IFTODT(sb.st_mode);
+	}
+
+	if (copyfile_tree_push(t, id, d, de->d_name, type) < 0)
+	{
+		ret = -1;
+		break;
+	}
+	}
+
+	closedir(dir);
+	return ret;
+}
+
+/*
+* Drop a reference to directory d, finishing it (and, in turn, maybe its
+* parent) if that was the last one.  The root of the tree belongs to the
+* caller, who takes care of it.
+*/
+static void copyfile_tree_put(struct copyfile_tree *t, copyfile_state_t s, struct copyfile_dir *d)
+{
+	struct copyfile_dir *parent;
+	char path[MAXPATHLEN];
+	unsigned refs;
+	int error, changed;
+
+	while (d != NULL)
+	{
+	pthread_mutex_lock(&t->lock);
+	refs = --d->refs;
+	error = t->error;
+	changed = d->changed;
+	pthread_mutex_unlock(&t->lock);
+
+	if (refs > 0 || d->parent == NULL)
+		return;
+
+	/* nothing in or about a directory the manifest has as it is has changed */
+	if (!error && d->same && !changed)
+		copyfile_debug(3, "%s is unchanged", d->name);
+	else if (!error)
+	{
+		s->src_dirfd = d->parent->src_fd;
+		s->dst_dirfd = d->parent->dst_fd;
+		s->src = s->dst = d->name;
+		s->src_fd = d->src_fd;
+		s->dst_fd = d->dst_fd;
+		s->sb = d->sb;
+		/* what's known of a destination is of the last file this state copied */
+		s->dst_sb_ok = 0;
+
+		if (copyfile_internal(s, s->flags) < 0)
+			copyfile_tree_fail(t);
+		else
+		{
+			if (!(s->flags & COPYFILE_STAT) && (d->sb.st_mode & S_IRWXU) != S_IRWXU)
+				(void)fchmod(d->dst_fd, d->sb.st_mode & ~S_IFMT);
+
+			/* COPYFILE_MOVE has removed everything it contained by now */
+			if ((s->flags & COPYFILE_MOVE) &&
+			    (copyfile_syscall(s), unlinkat(d->parent->src_fd, d->name, AT_REMOVEDIR)) < 0)
+				copyfile_debug(2, "cannot remove %s: %s", d->name, strerror(errno));
+		}
+
+		s->src = s->dst = NULL;
+		s->src_fd = s->dst_fd = -2;
+	}
+
+	if (!error && t->manifest && copyfile_tree_path(d->parent, d->name, path, sizeof path) == 0 &&
+	    copyfile_manifest_add(t, path, &d->sb, 0, 0) < 0)
+		copyfile_tree_fail(t);
+
+	close(d->src_fd);
+	if (close(d->dst_fd) < 0)
+		copyfile_tree_fail(t);
+
+	parent = d->parent;
+	free(d);
+	d = parent;
+	}
+}
+
+/*
+* Put the path of name in directory d, relative to the root of the tree,
+* in buf.  Fails if it doesn't fit.
+*/
+static int copyfile_tree_path(const struct copyfile_dir *d, const char *name, char *buf, size_t size)
+{
+	const struct copyfile_dir *p;
+	size_t len, at;
+
+	at = strlen(name);
+	for (p = d; p->parent != NULL; p = p->parent)
+		at += strlen(p->name) + 1;
+
+	if (at >= size)
+		return -1;
+
+	buf[at] = '\0';
+	len = strlen(name);
+	memcpy(buf + (at -= len), name, len);
+
+	for (p = d; p->parent != NULL; p = p->parent)
+	{
+		buf[--at] = '/';
+		len = strlen(p->name);
+		memcpy(buf + (at -= len), p->name, len);
+	}
+
+	return 0;
+}
+
+static size_t copyfile_tree_hash(dev_t dev, ino_t ino, size_t nbuckets)
+{
+	uint64_t h = ((uint64_t)dev * 0x9e3779b97f4a7c15ULL) ^ (uint64_t)ino;
+
+	h *= 0xff51afd7ed558ccdULL;
+	return (size_t)(h ^ (h >> 32)) & (nbuckets - 1);
+}
+
+/*
+* Map the manifest left by the last copy of the tree, if there is one
+* and it's for this very tree and destination; it's only an optimisation,
+* so anything else means copying as though there weren't one.
+*/
+static void copyfile_manifest_load(struct copyfile_tree *t)
+{
+	copyfile_state_t s = t->s;
+	const struct copyfile_manifest_header *h;
+	struct stat sb, dst_sb;
+	size_t off;
+	void *map;
+	int fd;
+
+	copyfile_syscall(s);
+	if ((fd = open(s->manifest, O_RDONLY | O_CLOEXEC)) < 0)
+	{
+	if (errno != ENOENT)
+		copyfile_debug(1, "cannot open manifest %s: %s", s->manifest, strerror(errno));
+	return;
+	}
+
+	s->stats.syscalls += 2;
+	if (fstat(fd, &sb) < 0 || sb.st_size < (off_t)sizeof *h ||
+	    (map = mmap(NULL, (size_t)sb.st_size, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED)
+	{
+	close(fd);
+	return;
+	}
+	close(fd);
+
+	/* the last path must be terminated, so that searching can't run off the end */
+	h = map;
+	off = sizeof *h + (size_t)h->count * sizeof *t->mentries;
+	if (memcmp(h->magic, COPYFILE_MANIFEST_MAGIC, sizeof h->magic) != 0 ||
+	    h->version != COPYFILE_MANIFEST_VERSION || off > (size_t)sb.st_size ||
+	    (h->count > 0 && (off == (size_t)sb.st_size || ((const char *)map)[sb.st_size - 1] != '\0')) ||
+	    h->src_ino != (uint64_t)s->sb.st_ino ||
+	    (copyfile_syscall(s), fstat(s->dst_fd, &dst_sb)) < 0 || h->dst_ino != (uint64_t)dst_sb.st_ino)
+	{
+	copyfile_debug(1, "ignoring manifest %s, which isn't one of this tree", s->manifest);
+	munmap(map, (size_t)sb.st_size);
+	return;
+	}
+
+	t->map = map;
+	t->maplen = (size_t)sb.st_size;
+	t->mentries = (const struct copyfile_manifest_entry *)(h + 1);
+	t->mcount = h->count;
+	t->mpaths = (const char *)map + off;
+	t->mpathslen = (size_t)sb.st_size - off;
+}
+
+/*
+* The last manifest's entry for path, relative to the root, or NULL.
+*/
+static const struct copyfile_manifest_entry *copyfile_manifest_find(struct copyfile_tree *t, const char *path)
+{
+	size_t lo = 0, hi = t->mcount, mid;
+	int cmp;
+
+	while (lo < hi)
+	{
+	mid = lo + (hi - lo) / 2;
+	if (t->mentries[mid].path >= t->mpathslen)
+		return NULL;
+	if ((cmp = strcmp(path, t->mpaths + t->mentries[mid].path)) == 0)
+		return &t->mentries[mid];
+	if (cmp < 0)
+		hi = mid;
+	else
+		lo = mid + 1;
+	}
+
+	return NULL;
+}
+
+static int copyfile_manifest_same(const struct copyfile_manifest_entry *m, const struct stat *sb)
+{
+	return ((m->flags & COPYFILE_MANIFEST_DIR) != 0) == S_ISDIR(sb->st_mode) &&
+	    m->size == (uint64_t)sb->st_size && m->ino == (uint64_t)sb->st_ino &&
+	    m->mtime == (int64_t)sb->st_mtim.tv_sec && m->mtime_nsec == (int32_t)sb->st_mtim.tv_nsec &&
+	    m->ctime == (int64_t)sb->st_ctim.tv_sec && m->ctime_nsec == (int32_t)sb->st_ctim.tv_nsec;
+}
+
+/*
+* Add path, as sb says it is, to the next manifest.
+*/
+static int copyfile_manifest_add(struct copyfile_tree *t, const char *path, const struct stat *sb, uint32_t flags, uint32_t crc)
+{
+	struct copyfile_record *r;
+	size_t len = strlen(path) + 1;
+	size_t size;
+	void *p;
+
+	pthread_mutex_lock(&t->manifest_lock);
+
+	if (t->nrecords == t->recordsize)
+	{
+	size = MAX(t->recordsize * 2, 1024);
+	if ((p = realloc(t->records, size * sizeof *t->records)) == NULL)
+		goto fail;
+	t->records = p;
+	t->recordsize = size;
+	}
+
+	if (t->pathslen + len > t->pathssize)
+	{
+	size = MAX(MAX(t->pathssize * 2, 64 * 1024), t->pathslen + len);
+	if ((p = realloc(t->paths, size)) == NULL)
+		goto fail;
+	t->paths = p;
+	t->pathssize = size;
+	}
+
+	r = &t->records[t->nrecords++];
+	memset(r, 0, sizeof *r);
+	r->e.path = t->pathslen;
+	r->e.size = (uint64_t)sb->st_size;
+	r->e.ino = (uint64_t)sb->st_ino;
+	r->e.mtime = (int64_t)sb->st_mtim.tv_sec;
+	r->e.mtime_nsec = (int32_t)sb->st_mtim.tv_nsec;
+	r->e.ctime = (int64_t)sb->st_ctim.tv_sec;
+	r->e.ctime_nsec = (int32_t)sb->st_ctim.tv_nsec;
+	r->e.crc = crc;
+	r->e.flags = flags | (S_ISDIR(sb->st_mode) ? COPYFILE_MANIFEST_DIR : 0);
+	memcpy(t->paths + t->pathslen, path, len);
+	t->pathslen += len;
+
+	pthread_mutex_unlock(&t->manifest_lock);
+	return 0;
+
+fail:
+	pthread_mutex_unlock(&t->manifest_lock);
+	return -1;
+}
+
+static int copyfile_record_cmp(const void *a, const void *b)
+{
+	return strcmp(((const struct copyfile_record *)a)->name, ((const struct copyfile_record *)b)->name);
+}
+
+static int copyfile_write_all(int fd, const void *buf, size_t len)
+{
+	const char *p = buf;
+	ssize_t n;
+
+	while (len > 0)
+	{
+	if ((n = write(fd, p, len)) < 0)
+	{
+		if (errno == EINTR)
+			continue;
+		return -1;
+	}
+	p += n;
+	len -= (size_t)n;
+	}
+
+	return 0;
+}
+
+/*
+* Write out the next manifest, once the whole tree has been copied.  It's
+* written under a temporary name and renamed into place, so that one
+* from a copy that didn't finish never gets used.
+*/
+static int copyfile_manifest_save(struct copyfile_tree *t)
+{
+	copyfile_state_t s = t->s;
+	struct copyfile_manifest_header h;
+	struct copyfile_manifest_entry *entries;
+	struct stat dst_sb;
+	char tmp[MAXPATHLEN];
+	size_t i;
+	int fd, err, ret = 0;
+
+	if (t->nrecords > UINT32_MAX)
+	{
+	errno = EFBIG;
+	return -1;
+	}
+
+	if (snprintf(tmp, sizeof tmp, "%s.XXXXXX", s->manifest) >= (int)sizeof tmp)
+	{
+	errno = ENAMETOOLONG;
+	return -1;
+	}
+
+	copyfile_syscall(s);
+	if (fstat(s->dst_fd, &dst_sb) < 0)
+		return -1;
+
+	for (i = 0; i < t->nrecords; i++)
+		t->records[i].name = t->paths + t->records[i].e.path;
+	qsort(t->records, t->nrecords, sizeof *t->records, copyfile_record_cmp);
+
+	if ((entries = malloc(MAX(t->nrecords, 1) * sizeof *entries)) == NULL)
+		return -1;
+	for (i = 0; i < t->nrecords; i++)
+		entries[i] = t->records[i].e;
+
+	memset(&h, 0, sizeof h);
+	memcpy(h.magic, COPYFILE_MANIFEST_MAGIC, sizeof h.magic);
+	h.version = COPYFILE_MANIFEST_VERSION;
+	h.count = (uint32_t)t->nrecords;
+	h.src_ino = (uint64_t)s->sb.st_ino;
+	h.dst_ino = (uint64_t)dst_sb.st_ino;
+
+	copyfile_syscall(s);
+	if ((fd = mkstemp(tmp)) < 0)
+	{
+	free(entries);
+	return -1;
+	}
+
+	s->stats.syscalls += 6;
+	if (copyfile_write_all(fd, &h, sizeof h) < 0 ||
+	    copyfile_write_all(fd, entries, t->nrecords * sizeof *entries) < 0 ||
+	    copyfile_write_all(fd, t->paths, t->pathslen) < 0 || fsync(fd) < 0)
+		ret = -1;
+
+	err = errno;
+	if (close(fd) < 0 && ret == 0)
+	{
+	err = errno;
+	ret = -1;
+	}
+
+	if (ret == 0 && rename(tmp, s->manifest) < 0)
+	{
+	err = errno;
+	ret = -1;
+	}
+
+	if (ret < 0)
+	{
+	(void)unlink(tmp);
+	errno = err;
+	}
+
+	free(entries);
+	return ret;
+}
+
+/* note that (some of) d's entries had to be copied */
+static void copyfile_tree_changed(struct copyfile_tree *t, struct copyfile_dir *d)
+{
+	pthread_mutex_lock(&t->lock);
+	d->changed = 1;
+	pthread_mutex_unlock(&t->lock);
+}
+
+/*
+* Link target to the first copy of its file, at path relative to the
+* root, or at tmp if that's not been renamed to path yet.  Trying path
+* again afterwards covers it being renamed in between.
+*/
+static int copyfile_tree_linkto(struct copyfile_tree *t, copyfile_state_t s, const char *path, const char *tmp, const char *target)
+{
+	int i;
+
+	for (i = 0; i < 3; i++)
+	{
+	copyfile_syscall(s);
+	if (linkat(t->s->dst_fd, i == 1 ? tmp : path, s->dst_dirfd, target, 0) == 0)
+		return 0;
+	if (errno != ENOENT || tmp[0] == '\0')
+		break;
+	}
+
+	return -1;
+}
+
+/*
+* e has just been opened in s, and has other hard links: if one of them
+* was copied already, replace what copyfile_open() created with a link
+* to that (returning 0), otherwise remember where this one goes and have
+* the caller copy it (returning 1).  Each destination is created before
+* it's remembered, so it can be linked to straight away, even while its
+* data is still being copied.  If the link can't be made (say the
+* destination has too many already), the file is just copied again.
+* With COPYFILE_ATOMIC, the destination still has its temporary name
+* while being copied, so that's remembered too.
+*/
+static int copyfile_tree_hardlink(struct copyfile_tree *t, copyfile_state_t s, struct copyfile_entry *e)
+{
+	struct copyfile_link *l, **links;
+	char path[MAXPATHLEN], tmp[MAXPATHLEN];
+	const char *target;
+	size_t i, h, nbuckets;
+	int ret;
+
+	pthread_mutex_lock(&t->links_lock);
+
+	if (t->nbuckets > 0)
+	for (l = t->links[copyfile_tree_hash(s->sb.st_dev, s->sb.st_ino, t->nbuckets)]; l != NULL; l = l->next)
+		if (l->dev == s->sb.st_dev && l->ino == s->sb.st_ino)
+			break;
+
+	if (t->nbuckets == 0 || l == NULL)
+	{
+	/* only looked up for COPYFILE_MOVE's sake: there are no other links to come */
+	if (s->sb.st_nlink == 1)
+	{
+		pthread_mutex_unlock(&t->links_lock);
+		return 1;
+	}
+
+	/* keep the chains short by doubling the buckets as they fill */
+	if (t->nlinks >= t->nbuckets)
+	{
+		nbuckets = MAX(t->nbuckets * 2, 64);
+		if ((links = calloc(nbuckets, sizeof *links)) != NULL)
+		{
+		for (i = 0; i < t->nbuckets; i++)
+		while ((l = t->links[i]) != NULL)
+		{
+			t->links[i] = l->next;
+			h = copyfile_tree_hash(l->dev, l->ino, nbuckets);
+			l->next = links[h];
+			links[h] = l;
+		}
+		free(t->links);
+		t->links = links;
+		t->nbuckets = nbuckets;
+		}
+	}
+
+	/* if it can't be remembered, its other links are just copied */
+	tmp[0] = '\0';
+	if (t->nbuckets > 0 && copyfile_tree_path(e->dir, e->name, path, sizeof path) == 0 &&
+	    (s->tmp == NULL || copyfile_tree_path(e->dir, s->tmp, tmp, sizeof tmp) == 0) &&
+	    (l = malloc(sizeof *l + strlen(path) + strlen(tmp) + 2)) != NULL)
+	{
+		l->dev = s->sb.st_dev;
+		l->ino = s->sb.st_ino;
+		strcpy(l->path, path);
+		strcpy(l->path + strlen(path) + 1, tmp);
+		h = copyfile_tree_hash(l->dev, l->ino, t->nbuckets);
+		l->next = t->links[h];
+		t->links[h] = l;
+		t->nlinks++;
+	}
+
+	pthread_mutex_unlock(&t->links_lock);
+	return 1;
+	}
+
+	strcpy(path, l->path);
+	strcpy(tmp, l->path + strlen(l->path) + 1);
+	pthread_mutex_unlock(&t->links_lock);
+
+	close(s->src_fd);
+	s->src_fd = -2;
+	if (close(s->dst_fd) < 0)
+	{
+	s->dst_fd = -2;
+	return -1;
+	}
+	s->dst_fd = -2;
+
+	/* under COPYFILE_ATOMIC, the link replaces dst as the copy would have */
+	target = s->tmp != NULL ? s->tmp : e->name;
+
+	copyfile_syscall(s);
+	if (unlinkat(s->dst_dirfd, target, 0) < 0 ||
+	    copyfile_tree_linkto(t, s, path, tmp, target) < 0 ||
+	    (s->tmp != NULL && (copyfile_syscall(s), renameat(s->dst_dirfd, s->tmp, s->dst_dirfd, e->name)) < 0))
+	{
+	copyfile_debug(2, "cannot link %s to %s (%s), copying it", e->name, path, strerror(errno));
+	if (s->tmp != NULL)
+	{
+		(void)unlinkat(s->dst_dirfd, s->tmp, 0);
+		free(s->tmp);
+		s->tmp = NULL;
+	}
+	return (ret = copyfile_open(s)) < 0 ? -1 : !ret;
+	}
+
+	free(s->tmp);
+	s->tmp = NULL;
+
+	copyfile_debug(3, "linked %s to %s", e->name, path);
+	s->stats.links++;
+	return 0;
+}
+
+/*
+* Copy a single entry of the tree with the worker's state.  The names are
+* only borrowed from the entry for the duration of the copy; ws never owns
+* them.
+*/
+static int copyfile_tree_copy(struct copyfile_tree *t, unsigned id, copyfile_state_t s, struct copyfile_entry *e)
+{
+	const struct copyfile_manifest_entry *m;
+	struct copyfile_dir *d;
+	struct stat sb;
+	char path[MAXPATHLEN];
+	size_t len;
+	int ret;
+
+	/* whole subtrees are moved at once, if they can be */
+	if (copyfile_can_move(s) &&
+	    (ret = copyfile_move(s, e->dir->src_fd, e->name, e->dir->dst_fd, e->name)) <= 0)
+		return ret;
+
+	/* entries too deep to name are copied, but left out of the manifest */
+	path[0] = '\0';
+	if (t->manifest && (e->type == DT_REG || e->type == DT_DIR) &&
+	    copyfile_tree_path(e->dir, e->name, path, sizeof path) < 0)
+		path[0] = '\0';
+
+	/*
+	* A file the manifest has as it is now was copied last time, and
+	* the destination doesn't need looking at -- unless its directory
+	* has only just been made.
+	*/
+	if (path[0] != '\0' && e->type == DT_REG && !e->dir->fresh &&
+	    (copyfile_syscall(s), fstatat(e->dir->src_fd, e->name, &sb, AT_SYMLINK_NOFOLLOW)) == 0 &&
+	    sb.st_nlink == 1 && (m = copyfile_manifest_find(t, path)) != NULL &&
+	    copyfile_manifest_same(m, &sb))
+	{
+	copyfile_debug(3, "%s is unchanged", path);
+	s->stats.uptodate++;
+	return copyfile_manifest_add(t, path, &sb, m->flags & COPYFILE_MANIFEST_CRC, m->crc);
+	}
+
+	s->src_dirfd = e->dir->src_fd;
+	s->dst_dirfd = e->dir->dst_fd;
+	s->src = s->dst = e->name;
+	s->src_fd = s->dst_fd = -2;
+
+	if (e->type == DT_LNK)
+	{
+	ret = copyfile_symlink(s, s->src_dirfd, e->name, s->dst_dirfd, e->name);
+	goto exit;
+	}
+
+	copyfile_debug(3, "copying %s", e->name);
+
+	if ((ret = copyfile_open(s)) != 0)
+		goto exit;
+
+	/*
+	* Under COPYFILE_MOVE, the names of a file that's been moved already
+	* are gone by the time its others come up, so any file may be one.
+	*/
+	if (S_ISREG(s->sb.st_mode) && (s->sb.st_nlink > 1 || (s->flags & COPYFILE_MOVE)) &&
+	    (ret = copyfile_tree_hardlink(t, s, e)) <= 0)
+		goto exit;
+
+	if (!S_ISDIR(s->sb.st_mode))
+	{
+	ret = copyfile_internal(s, s->flags);
+
+	if (ret == 0 && path[0] != '\0' && S_ISREG(s->sb.st_mode) && s->sb.st_nlink == 1 &&
+	    copyfile_manifest_add(t, path, &s->sb,
+	    (s->checksum != COPYFILE_CHECKSUM_NONE && !s->uptodate) ? COPYFILE_MANIFEST_CRC : 0,
+	    s->digest) < 0)
+		ret = -1;
+	goto exit;
+	}
+
+	/* from here on, the directory's descriptors belong to d */
+	len = strlen(e->name) + 1;
+	if ((d = malloc(sizeof *d + len)) == NULL)
+	{
+	ret = -1;
+	goto exit;
+	}
+
+	d->parent = e->dir;
+	d->src_fd = s->src_fd;
+	d->dst_fd = s->dst_fd;
+	d->sb = s->sb;
+	d->refs = 1;
+	d->fresh = s->created;
+	d->same = path[0] != '\0' && !s->created &&
+	    (m = copyfile_manifest_find(t, path)) != NULL && copyfile_manifest_same(m, &s->sb);
+	d->changed = 0;
+	memcpy(d->name, e->name, len);
+
+	if (t->manifest && s->created)
+		copyfile_tree_changed(t, e->dir);
+
+	pthread_mutex_lock(&t->lock);
+	e->dir->refs++;
+	pthread_mutex_unlock(&t->lock);
+
+	s->src = s->dst = NULL;
+	s->src_fd = s->dst_fd = -2;
+
+	if ((ret = copyfile_tree_list(t, id, d)) < 0)
+		copyfile_tree_fail(t);
+
+	copyfile_tree_put(t, s, d);
+	return ret;
+
+exit:
+	if (t->manifest)
+		copyfile_tree_changed(t, e->dir);
+
+	/* directories are only removed once they've been emptied, in copyfile_tree_put() */
+	if (ret >= 0 && (s->flags & COPYFILE_MOVE))
+	{
+	copyfile_syscall(s);
+	if (unlinkat(s->src_dirfd, e->name, 0) < 0)
+		copyfile_debug(2, "cannot remove %s: %s", e->name, strerror(errno));
+	}
+
+	if (s->src_fd >= 0)
+		close(s->src_fd);
+	if (s->dst_fd >= 0 && close(s->dst_fd) < 0)
+		ret = -1;
+	s->src = s->dst = NULL;
+	s->src_fd = s->dst_fd = -2;
+	return ret;
+}
+
+static void *copyfile_tree_worker(void *arg)
+{
+	struct copyfile_worker *w = arg;
+	struct copyfile_tree *t = w->t;
+	struct copyfile_entry *e;
+	struct copyfile_dir *d;
+	int stop;
+
+	while ((e = copyfile_tree_pop(t, w->id, &stop)) != NULL)
+	{
+	d = e->dir;
+
+	if (!stop && copyfile_tree_copy(t, w->id, w->ws, e) < 0)
+		copyfile_tree_fail(t);
+
+	free(e);
+	copyfile_tree_put(t, w->ws, d);
+
+	pthread_mutex_lock(&t->lock);
+	if (--t->pending == 0)
+		pthread_cond_broadcast(&t->wake);
+	pthread_mutex_unlock(&t->lock);
+	}
+
+	if (copyfile_sync_flush(w->ws) < 0)
+		copyfile_tree_fail(t);
+
+	return NULL;
+}
+
+/*
+* COPYFILE_RECURSIVE: copy the contents of the directory s refers to (which
+* has already been opened, and its destination created, by copyfile_open()).
+* The calling thread lists it and then works alongside the others.  The
+* destination directory was made writable so its children could be
+* created, so its permissions are put back afterwards if COPYFILE_STAT
+* won't be doing it.
+*/
+static int copyfile_tree(copyfile_state_t s)
+{
+	struct copyfile_tree t;
+	struct copyfile_worker *workers;
+	struct copyfile_dir *root;
+	unsigned i, nstarted;
+	long ncpu;
+	int ret = 0;
+
+	memset(&t, 0, sizeof t);
+	t.s = s;
+	t.nworkers = s->nthreads;
+
+	if (t.nworkers == 0)
+		t.nworkers = (ncpu = sysconf(_SC_NPROCESSORS_ONLN)) > 0 ? (unsigned)ncpu : 1;
+
+	if ((root = malloc(sizeof *root + 1)) == NULL)
+		return -1;
+
+	root->parent = NULL;
+	root->src_fd = s->src_fd;
+	root->dst_fd = s->dst_fd;
+	root->sb = s->sb;
+	root->refs = 1;
+	root->fresh = s->created;
+	root->same = root->changed = 0;
+	root->name[0] = '\0';
+
+	workers = calloc(t.nworkers, sizeof *workers);
+	t.queues = calloc(t.nworkers, sizeof *t.queues);
+
+	if (workers == NULL || t.queues == NULL)
+	{
+	free(workers);
+	free(t.queues);
+	free(root);
+	return -1;
+	}
+
+	pthread_mutex_init(&t.lock, NULL);
+	pthread_cond_init(&t.wake, NULL);
+	pthread_mutex_init(&t.links_lock, NULL);
+	pthread_mutex_init(&t.manifest_lock, NULL);
+
+	/* there'd be nothing left to index after COPYFILE_MOVE */
+	if ((t.manifest = s->manifest != NULL && !(s->flags & COPYFILE_MOVE)))
+		copyfile_manifest_load(&t);
+
+	for (i = 0; i < t.nworkers; i++)
+	{
+	pthread_mutex_init(&t.queues[i].lock, NULL);
+	workers[i].t = &t;
+	workers[i].id = i;
+	if ((workers[i].ws = copyfile_state_child(s)) == NULL)
+		ret = -1;
+	}
+
+	if (ret == 0 && copyfile_tree_list(&t, 0, root) < 0)
+		ret = -1;
+
+	if (ret < 0)
+		copyfile_tree_fail(&t);
+
+	/* if some threads can't be started, there's just fewer of them */
+	for (nstarted = 1; nstarted < t.nworkers; nstarted++)
+	{
+	if (ret < 0 || pthread_create(&workers[nstarted].thread, NULL,
+	    copyfile_tree_worker, &workers[nstarted]) != 0)
+		break;
+	}
+
+	/*
+	* After an error, that's all the calling thread does, dropping
+	* whatever was queued before listing the top failed -- unless it
+	* has no state, in which case nothing was.
+	*/
+	if (workers[0].ws != NULL)
+		copyfile_tree_worker(&workers[0]);
+
+	for (i = 1; i < nstarted; i++)
+		pthread_join(workers[i].thread, NULL);
+
+	copyfile_tree_put(&t, workers[0].ws, root);
+	free(root);
+
+	if (t.error == 0 && t.manifest && copyfile_manifest_save(&t) < 0)
+	{
+		copyfile_warn("writing manifest %s", s->manifest);
+		t.error = errno;
+	}
+
+	if (t.error != 0)
+		ret = -1;
+	else if (!(s->flags & COPYFILE_STAT) && (s->sb.st_mode & S_IRWXU) != S_IRWXU)
+		(void)fchmod(s->dst_fd, s->sb.st_mode & ~S_IFMT);
+
+	for (i = 0; i < t.nworkers; i++)
+	{
+	if (workers[i].ws != NULL)
+	{
+	copyfile_stats_add(&s->stats, &workers[i].ws->stats);
+	/* each charged for its own already */
+	s->tb_syscalls += workers[i].ws->stats.syscalls;
+	}
+	copyfile_state_free(workers[i].ws);
+	free(t.queues[i].entries);
+	pthread_mutex_destroy(&t.queues[i].lock);
+	}
+
+	for (i = 0; i < t.nbuckets; i++)
+	{
+	struct copyfile_link *l;
+
+	while ((l = t.links[i]) != NULL)
+	{
+		t.links[i] = l->next;
+		free(l);
+	}
+	}
+	free(t.links);
+
+	if (t.map != NULL)
+		munmap(t.map, t.maplen);
+	free(t.records);
+	free(t.paths);
+
+	pthread_mutex_destroy(&t.manifest_lock);
+	pthread_mutex_destroy(&t.links_lock);
+	pthread_cond_destroy(&t.wake);
+	pthread_mutex_destroy(&t.lock);
+	free(t.queues);
+	free(workers);
+
+	if (ret < 0)
+		errno = t.error ? t.error : EIO;
+	return ret;
+}
+
+/*
+* CRC32C, with the SSE4.2 or ARMv8 CRC instructions where the CPU has
+* them, and slicing-by-8 tables otherwise.  The running value is kept
+* inverted, as the instructions want it.
+*/
+#define COPYFILE_CRC32C_POLY	0x82f63b78U
+
+static uint32_t copyfile_crc32c_table[8][256];
+static pthread_once_t copyfile_crc32c_once = PTHREAD_ONCE_INIT;
+static uint32_t (*copyfile_crc32c_update)(uint32_t, const unsigned char *, size_t);
+
+static uint32_t copyfile_crc32c_sw(uint32_t crc, const unsigned char *p, size_t len)
+{
+	uint64_t v;
+
+	while (len > 0 && ((uintptr_t)p & 7) != 0)
+	{
+		crc = copyfile_crc32c_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+		len--;
+	}
+
+	for (; len >= 8; p += 8, len -= 8)
+	{
+		memcpy(&v, p, sizeof v);
+#if BYTE_ORDER == BIG_ENDIAN
+		v = __builtin_bswap64(v);
+#endif
+		v ^= crc;
+		crc = copyfile_crc32c_table[7][v & 0xff] ^
+		    copyfile_crc32c_table[6][(v >> 8) & 0xff] ^
+		    copyfile_crc32c_table[5][(v >> 16) & 0xff] ^
+		    copyfile_crc32c_table[4][(v >> 24) & 0xff] ^
+		    copyfile_crc32c_table[3][(v >> 32) & 0xff] ^
+		    copyfile_crc32c_table[2][(v >> 40) & 0xff] ^
+		    copyfile_crc32c_table[1][(v >> 48) & 0xff] ^
+		    copyfile_crc32c_table[0][v >> 56];
+	}
+
+	while (len-- > 0)
+		crc = copyfile_crc32c_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+
+	return crc;
+}
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+# define HAVE_CRC32C_HW 1
+
+__attribute__((target("sse4.2")))
+static uint32_t copyfile_crc32c_hw(uint32_t crc, const unsigned char *p, size_t len)
+{
+	uint64_t c = crc, v;
+
+	for (; len >= 8; p += 8, len -= 8)
+	{
+		memcpy(&v, p, sizeof v);
+		c = __builtin_ia32_crc32di(c, v);
+	}
+
+	while (len-- > 0)
+		c = __builtin_ia32_crc32qi((uint32_t)c, *p++);
+
+	return (uint32_t)c;
+}
+
+static int copyfile_crc32c_hw_ok(void)
+{
+	return __builtin_cpu_supports("sse4.2");
+}
+#elif defined(__aarch64__) && defined(__clang__)
+# define HAVE_CRC32C_HW 1
+# include <arm_acle.h>
+# include <sys/auxv.h>
+
+__attribute__((target("crc")))
+static uint32_t copyfile_crc32c_hw(uint32_t crc, const unsigned char *p, size_t len)
+{
+	uint64_t v;
+
+	for (; len >= 8; p += 8, len -= 8)
+	{
+		memcpy(&v, p, sizeof v);
+		crc = __crc32cd(crc, v);
+	}
+
+	while (len-- > 0)
+		crc = __crc32cb(crc, *p++);
+
+	return crc;
+}
+
+static int copyfile_crc32c_hw_ok(void)
+{
+	u_long hwcap = 0;
+
+	return elf_aux_info(AT_HWCAP, &hwcap, sizeof hwcap) == 0 && (hwcap & HWCAP_CRC32);
+}
+#endif
+
+static void copyfile_crc32c_init(void)
+{
+	uint32_t crc;
+	int i, j;
+
+	for (i = 0; i < 256; i++)
+	{
+		crc = (uint32_t)i;
+		for (j = 0; j < 8; j++)
+			crc = (crc >> 1) ^ (COPYFILE_CRC32C_POLY & -(crc & 1));
+		copyfile_crc32c_table[0][i] = crc;
+	}
+
+	for (i = 0; i < 256; i++)
+	for (j = 1; j < 8; j++)
+		copyfile_crc32c_table[j][i] = copyfile_crc32c_table[0][copyfile_crc32c_table[j - 1][i] & 0xff] ^
+		    (copyfile_crc32c_table[j - 1][i] >> 8);
+
+	copyfile_crc32c_update = copyfile_crc32c_sw;
+#ifdef HAVE_CRC32C_HW
+	if (copyfile_crc32c_hw_ok())
+		copyfile_crc32c_update = copyfile_crc32c_hw;
+#endif
+}
+
+/*
+* Start the current file's checksum over, if there's to be one: there's
+* only CRC32C for now, which is also what COPYFILE_VERIFY defaults to.
+*/
+static void copyfile_hash_start(copyfile_state_t s)
+{
+	s->hashing = s->checksum != COPYFILE_CHECKSUM_NONE || (s->flags & COPYFILE_VERIFY);
+	s->digest = 0;
+
+	if (!s->hashing)
+		return;
+
+	(void)pthread_once(&copyfile_crc32c_once, copyfile_crc32c_init);
+	s->crc = 0xffffffffU;
+}
+
+/*
+* Feed data on its way to the destination into the checksum.
+*/
+static void copyfile_hash(copyfile_state_t s, const void *ptr, size_t len)
+{
+	if (s->hashing)
+		s->crc = copyfile_crc32c_update(s->crc, ptr, len);
+}
+
+/*
+* ... and the zeros of a hole, which never are.
+*/
+static void copyfile_hash_zeros(copyfile_state_t s, off_t len)
+{
+	static const unsigned char zeros[4096];
+
+	if (!s->hashing)
+		return;
+
+	for (; len > 0; len -= MIN(len, (off_t)sizeof zeros))
+		s->crc = copyfile_crc32c_update(s->crc, zeros, (size_t)MIN(len, (off_t)sizeof zeros));
+}
+
+/*
+* Compute the checksum of everything in fd, without moving its offset,
+* for COPYFILE_VERIFY (and for clones, whose data we never get to see).
+*/
+static int copyfile_hash_fd(copyfile_state_t s, int fd, uint32_t *digest)
+{
+	off_t off = 0;
+	ssize_t n;
+	uint32_t crc = 0xffffffffU;
+
+	if (copyfile_buf(s, COPYFILE_VERIFY_BLOCK) < 0)
+		return -1;
+
+	while ((copyfile_syscall(s), n = pread(fd, s->buf, s->buflen, off)) != 0)
+	{
+	if (n < 0)
+	{
+		if (errno == EINTR)
+			continue;
+		return -1;
+	}
+	crc = copyfile_crc32c_update(crc, (const unsigned char *)s->buf, (size_t)n);
+	off += n;
+	}
+
+	*digest = ~crc;
+	return 0;
+}
+
+/*
+* Scratch shared between copyfile_data() and the routines that move
+* the bytes for it: kernel, mmap and pipeline say which of these engines
+* are yet to be tried.  The state's buffer is only set up once they all have
+* been, and refused to do the copy for us.  blen is how much of it is used per
+* read(), which may be less than what is allocated; while it is still
+* allowed to grow (bmax != 0), nbytes and since track the throughput
+* achieved with it.
+*/
+struct copyfile_io
+{
+	size_t blen;
+	size_t bmax;
+	int kernel;
+	int mmap;
+	int pipeline;
+	off_t nbytes;
+	struct timespec since;
+	double rate;
+};
+
+#ifdef O_DIRECT
+/*
+* Put both descriptors in O_DIRECT mode for COPYFILE_NOCACHE, saving
+* their flags in *sfl and *dfl so they can be put back afterwards.
+* Returns -1 if either can't do direct I/O.
+*/
+static int copyfile_direct(copyfile_state_t s, int *sfl, int *dfl)
+{
+	s->stats.syscalls += 2;
+	if ((*sfl = fcntl(s->src_fd, F_GETFL)) < 0 || (*dfl = fcntl(s->dst_fd, F_GETFL)) < 0)
+		return -1;
+
+	s->stats.syscalls += 2;
+	if (fcntl(s->src_fd, F_SETFL, *sfl | O_DIRECT) < 0)
+		return -1;
+	if (fcntl(s->dst_fd, F_SETFL, *dfl | O_DIRECT) < 0)
+	{
+	(void)fcntl(s->src_fd, F_SETFL, *sfl);
+	return -1;
+	}
+
+	s->direct = 1;
+	return 0;
+}
+#endif
+
+/*
+* Take the descriptors back out of O_DIRECT mode when direct I/O turns
+* down a read or write (EINVAL), as it does the odd-sized tail of a
+* file.  *direct says whether they're in it as far as the caller knows,
+* and is cleared, so that it only retries once: returns -1 if it was
+* already.
+*/
+static int copyfile_undirect(copyfile_state_t s, int *direct)
+{
+	if (!*direct)
+		return -1;
+
+	*direct = 0;
+#ifdef O_DIRECT
+	(void)fcntl(s->src_fd, F_SETFL, fcntl(s->src_fd, F_GETFL) & ~O_DIRECT);
+	(void)fcntl(s->dst_fd, F_SETFL, fcntl(s->dst_fd, F_GETFL) & ~O_DIRECT);
+#endif
+	copyfile_debug(3, "direct I/O refused for %s, going through the cache", s->src);
+
+	return 0;
+}
+
+/*
+* Tell the kernel it can drop whatever it has cached of both files, for
+* COPYFILE_NOCACHE.  It's done for the whole of them, as the engines
+* don't all copy in order; only what was copied since the last time is
+* still around, so that's all it has to look at.
+*/
+static void copyfile_nocache_drop(copyfile_state_t s)
+{
+	s->stats.syscalls += 2;
+	(void)posix_fadvise(s->src_fd, 0, 0, POSIX_FADV_DONTNEED);
+	(void)posix_fadvise(s->dst_fd, 0, 0, POSIX_FADV_DONTNEED);
+	s->dropped = s->copied;
+}
+
+/*
+* Top up the throttle's buckets for the time since they were last, up to
+* a tenth of a second's worth.
+*/
+static void copyfile_throttle_refill(struct copyfile_throttle *tb, uint64_t now)
+{
+	double secs = (now - tb->last) / 1e9;
+
+	tb->last = now;
+	tb->bytes = tb->bps ? MIN(tb->bytes + secs * tb->bps, COPYFILE_THROTTLE_BURST(tb->bps)) : 0;
+	tb->nops = tb->ops ? MIN(tb->nops + secs * tb->ops, COPYFILE_THROTTLE_BURST(tb->ops)) : 0;
+}
+
+/*
+* Charge bytes and ops to the state's throttle, and wait for as long as
+* that leaves it overdrawn.  Returns how long that was, in nanoseconds.
+*/
+static uint64_t copyfile_throttle(copyfile_state_t s, uint64_t bytes, uint64_t ops)
+{
+	struct copyfile_throttle *tb = s->tb;
+	struct timespec ts;
+	uint64_t now, start = 0, wait;
+
+	pthread_mutex_lock(&tb->lock);
+	if (tb->bps == 0 && tb->ops == 0)
+	{
+	pthread_mutex_unlock(&tb->lock);
+	return 0;
+	}
+
+	copyfile_throttle_refill(tb, copyfile_now());
+	if (tb->bps)
+	tb->bytes -= bytes;
+	if (tb->ops)
+	tb->nops -= ops;
+
+	for (;;)
+	{
+	wait = 0;
+	if (tb->bps && tb->bytes < 0)
+		wait = (uint64_t)(-tb->bytes * 1e9 / tb->bps);
+	if (tb->ops && tb->nops < 0)
+		wait = MAX(wait, (uint64_t)(-tb->nops * 1e9 / tb->ops));
+	if (wait == 0)
+		break;
+
+	pthread_mutex_unlock(&tb->lock);
+
+	now = copyfile_now();
+	if (start == 0)
+		start = now;
+	wait = MIN(wait, COPYFILE_THROTTLE_SLICE);
+	ts.tv_sec = (time_t)(wait / 1000000000);
+	ts.tv_nsec = (long)(wait % 1000000000);
+	(void)nanosleep(&ts, NULL);
+
+	pthread_mutex_lock(&tb->lock);
+	copyfile_throttle_refill(tb, copyfile_now());
+	}
+	pthread_mutex_unlock(&tb->lock);
+
+	return start ? copyfile_now() - start : 0;
+}
+
+/*
+* Change one of the throttle's rates.  Turning one on starts its bucket
+* out empty.
+*/
+static void copyfile_throttle_set(copyfile_state_t s, uint64_t *rate, uint64_t value)
+{
+	struct copyfile_throttle *tb = s->tb;
+
+	pthread_mutex_lock(&tb->lock);
+	copyfile_throttle_refill(tb, copyfile_now());
+	*rate = value;
+	tb->bytes = MIN(tb->bytes, COPYFILE_THROTTLE_BURST(tb->bps));
+	tb->nops = MIN(tb->nops, COPYFILE_THROTTLE_BURST(tb->ops));
+	pthread_mutex_unlock(&tb->lock);
+}
+
+/* whether there's a throttle to answer to at all */
+static int copyfile_throttled(copyfile_state_t s)
+{
+	int ret;
+
+	pthread_mutex_lock(&s->tb->lock);
+	ret = s->tb->bps != 0 || s->tb->ops != 0;
+	pthread_mutex_unlock(&s->tb->lock);
+
+	return ret;
+}
+
+static int copyfile_report(copyfile_state_t s, off_t n);
+
+/*
+* Charge the throttle for the system calls made since the last time, and
+* for bytes more bytes of data.
+*/
+static void copyfile_throttle_charge(copyfile_state_t s, uint64_t bytes)
+{
+	uint64_t ops = s->stats.syscalls - s->tb_syscalls;
+
+	s->tb_syscalls = s->stats.syscalls;
+	s->stats.throttled_ns += copyfile_throttle(s, bytes, ops);
+}
+
+/*
+* Account for n more bytes of the current file having been copied, and
+* tell the progress callback about it every progress_interval bytes,
+* having had the throttle wait if need be.  Returns -1, with errno set
+* to ECANCELED, if it asked us to stop.
+*/
+static int copyfile_progress(copyfile_state_t s, off_t n)
+{
+	if (n > 0)
+	copyfile_throttle_charge(s, (uint64_t)n);
+
+	return copyfile_report(s, n);
+}
+
+/*
+* copyfile_progress(), without the throttle, which the chunk workers
+* answer to on their own.
+*/
+static int copyfile_report(copyfile_state_t s, off_t n)
+{
+	s->stats.bytes += n;
+	s->copied += n;
+
+	if (n > 0)
+	COPYFILE_DATA_CHUNK(copyfile_probe_path(s->src), (long long)n, (long long)s->copied);
+
+	if ((s->flags & COPYFILE_NOCACHE) && s->copied - s->dropped >= COPYFILE_NOCACHE_WINDOW)
+	copyfile_nocache_drop(s);
+
+	if (s->progress == NULL || s->copied < s->progress_next)
+		return 0;
+
+	s->progress_next = s->copied + MAX(s->progress_interval, 1);
+
+	if (s->progress(s, s->copied, s->sb.st_size, s->progress_ctx) == COPYFILE_QUIT)
+	{
+	copyfile_debug(1, "copy of %s cancelled by progress callback", s->src);
+	errno = ECANCELED;
+	return -1;
+	}
+
+	return 0;
+}
+
+/*
+* How much to hand to a single system call that may copy as much as we
+* want, so that the progress callback still gets called along the way.
+*/
+static off_t copyfile_data_step(copyfile_state_t s, off_t len)
+{
+	if (s->progress != NULL)
+		len = MIN(len, MAX(s->progress_interval, COPYFILE_TUNE_BYTES));
+
+	/* nor can the throttle keep up with one doing it all at once */
+	if (copyfile_throttled(s))
+		len = MIN(len, COPYFILE_TUNE_BYTES);
+
+	return MIN(len, SSIZE_MAX);
+}
+
+/*
+* Send the source from its current offset to a socket destination with
+* sendfile(2), which hands the pages over to the socket without their
+* ever crossing into userland.  COPYFILE_NOCACHE asks it not to keep
+* them cached afterwards, and COPYFILE_STATE_BLOCKSIZE how far to read
+* ahead.  The source's offset is moved past whatever was sent, so that
+* after EAGAIN from a non-blocking socket, calling fcopyfile() again
+* once the socket is writable picks up where this left off; progress is
+* counted from that offset, so the callback sees how far into the file
+* it has got over all the calls.
+*/
+static int copyfile_data_send(copyfile_state_t s)
+{
+	off_t off, sent;
+	int sflags = 0, ret = 0, err = 0;
+
+#ifdef SF_NOCACHE
+	if (s->flags & COPYFILE_NOCACHE)
+	sflags |= SF_NOCACHE;
+#endif
+#ifdef SF_FLAGS
+	if (s->blksize != 0)
+	sflags = SF_FLAGS(MIN(s->blksize / (size_t)sysconf(_SC_PAGESIZE), 0xffff), sflags);
+#endif
+
+	copyfile_syscall(s);
+	if ((off = lseek(s->src_fd, 0, SEEK_CUR)) < 0)
+		return -1;
+
+	s->copied = off;
+	s->progress_next = off + s->progress_interval;
+
+	while (off < s->sb.st_size)
+	{
+	sent = 0;
+	copyfile_syscall(s);
+	ret = sendfile(s->src_fd, s->dst_fd, off, (size_t)copyfile_data_step(s, s->sb.st_size - off),
+	    NULL, &sent, sflags);
+	err = errno;
+	off += sent;
+
+	if (sent > 0 && copyfile_progress(s, sent) < 0)
+	{
+		err = errno;
+		ret = -1;
+		break;
+	}
+
+	if (ret < 0)
+	{
+		if (err == EINTR)
+		{
+			ret = 0;
+			continue;
+		}
+		if (err == EAGAIN)
+			copyfile_debug(2, "socket full after %jd bytes of %s", (intmax_t)off, s->src);
+		else
+			copyfile_warn("sending %s", s->src);
+		break;
+	}
+
+	/* the source shrank under us */
+	if (sent == 0)
+		break;
+	}
+
+	copyfile_syscall(s);
+	(void)lseek(s->src_fd, off, SEEK_SET);
+
+	if (ret < 0)
+	{
+	errno = err;
+	return -1;
+	}
+
+	return 0;
+}
+
+#ifdef HAVE_COPY_FILE_RANGE
+
+/*
+* Have the kernel move up to len bytes with copy_file_range(2), so they
+* never have to cross into userland (and, on ZFS with block cloning, may
+* not need to be copied at all).  Both descriptors are used at their
+* current offsets, exactly like copyfile_data_loop().  Returns 1 if the
+* kernel can't do this for the given pair of files, in which case the
+* caller should fall back to copying through a buffer.
+*/
+static int copyfile_data_kernel(copyfile_state_t s, off_t len)
+{
+	ssize_t ncopied;
+
+	while (len > 0) {
+		copyfile_syscall(s);
+		ncopied = copy_file_range(s->src_fd, NULL, s->dst_fd, NULL,
+		    (size_t)copyfile_data_step(s, len), 0);
+
+		if (ncopied > 0) {
+			len -= ncopied;
+			if (copyfile_progress(s, ncopied) < 0)
+				return -1;
+			continue;
+		}
+
+		if (ncopied == 0)
+			break;
+
+		switch (errno) {
+		case EINTR:
+			continue;
+		case EXDEV:
+		case EINVAL:
+		case ENOSYS:
+		case EOPNOTSUPP:
+			/*
+			* Anything copied so far has advanced both offsets, so
+			* the read/write loop will just pick up where we left off.
+			*/
+			copyfile_debug(3, "copy_file_range not usable (%s), falling back", strerror(errno));
+			return 1;
+		default:
+			copyfile_warn("copy_file_range from %s", s->src);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+#endif
+
+/*
+* COPYFILE_CLONE: have the kernel share the source's blocks with the
+* destination rather than copy them, which only ZFS block cloning knows
+* how to do.  COPY_FILE_RANGE_CLONE makes it fail rather than quietly
+* copy, so we can tell which happened; without it, there is no asking.
+* Returns 1 if the files can't be cloned, in which case the caller should
+* copy them instead, from wherever this left off.
+*/
+static int copyfile_data_clone(copyfile_state_t s)
+{
+#ifdef HAVE_COPY_FILE_CLONE
+	off_t len = s->sb.st_size;
+	ssize_t ncloned;
+
+	while (len > 0) {
+		copyfile_syscall(s);
+		ncloned = copy_file_range(s->src_fd, NULL, s->dst_fd, NULL,
+		    (size_t)copyfile_data_step(s, len), COPY_FILE_RANGE_CLONE);
+
+		if (ncloned > 0) {
+			len -= ncloned;
+			if (copyfile_progress(s, ncloned) < 0)
+				return -1;
+			continue;
+		}
+
+		if (ncloned == 0)
+			break;
+
+		switch (errno) {
+		case EINTR:
+			continue;
+		case EXDEV:
+		case EINVAL:
+		case ENOSYS:
+		case EOPNOTSUPP:
+			return 1;
+		default:
+			copyfile_warn("cloning %s", s->src);
+			return -1;
+		}
+	}
+
+	s->cloned = 1;
+	s->stats.clones++;
+	return 0;
+#else
+	(void)s;
+	errno = EOPNOTSUPP;
+	return 1;
+#endif
+}
+
+/*
+* When the block size is picked automatically, keep doubling it for as
+* long as that pays off: every COPYFILE_TUNE_CHUNKS chunks or so, the
+* throughput is compared to the one measured before the last increase,
+* and growth stops (going back to the previous size) as soon as a bigger
+* buffer turns out to be noticeably slower.  Failing to allocate a bigger
+* buffer isn't an error, it just stops the growth.
+*/
+static void copyfile_data_tune(copyfile_state_t s, struct copyfile_io *io, size_t n)
+{
+	struct timespec now;
+	double elapsed, rate;
+	size_t nlen;
+	char *bp;
+
+	io->nbytes += n;
+	if (io->nbytes < (off_t)MAX(io->blen * COPYFILE_TUNE_CHUNKS, COPYFILE_TUNE_BYTES))
+		return;
+
+	(void)clock_gettime(CLOCK_MONOTONIC, &now);
+	elapsed = (now.tv_sec - io->since.tv_sec) + (now.tv_nsec - io->since.tv_nsec) / 1e9;
+	rate = elapsed > 0 ? io->nbytes / elapsed : 0;
+
+	if (rate != 0 && rate < io->rate * 0.9)
+	{
+	copyfile_debug(3, "block size %zu slower than %zu, settling", io->blen, io->blen / 2);
+	io->blen /= 2;
+	io->bmax = 0;
+	return;
+	}
+
+	nlen = MIN(io->blen * 2, io->bmax);
+	if (nlen > s->buflen)
+	{
+	if ((bp = copyfile_buf_alloc(nlen)) == NULL)
+	{
+		io->bmax = 0;
+		return;
+	}
+	free(s->buf);
+	s->buf = bp;
+	s->buflen = nlen;
+	}
+
+	copyfile_debug(3, "growing block size %zu -> %zu", io->blen, nlen);
+	io->blen = nlen;
+	if (io->blen >= io->bmax)
+	io->bmax = 0;
+
+	io->rate = rate;
+	io->nbytes = 0;
+	io->since = now;
+}
+
+/*
+* Write all of ptr to the current offset of the destination.
+*/
+static int copyfile_data_write(copyfile_state_t s, const char *ptr, size_t left)
+{
+	ssize_t nwritten;
+	int loop = 0;
+
+	/* whichever engine it came from, data copied through userland is here */
+	copyfile_hash(s, ptr, left);
+
+	while (left > 0) {
+		copyfile_syscall(s);
+		nwritten = write(s->dst_fd, ptr, left);
+		switch (nwritten) {
+		case 0:
+			if (++loop > 5) {
+				copyfile_warn("writing to output %d times resulted in 0 bytes written", loop);
+				errno = EAGAIN;
+				return -1;
+			}
+			break;
+		case -1:
+			/* direct I/O won't take the odd-sized tail */
+			if (errno == EINVAL && copyfile_undirect(s, &s->direct) == 0)
+				break;
+			copyfile_warn("writing to output file got error");
+			return -1;
+		default:
+			left -= nwritten;
+			ptr += nwritten;
+			break;
+		}
+	}
+
+	return 0;
+}
+
+/*
+* Copy up to len bytes from the current offset of the source to the
+* current offset of the destination straight out of a mapping of the
+* source, so they're never copied into a buffer of ours first.  The
+* source is mapped a window at a time, each unmapped as soon as it's
+* been written out.  Returns 1 if the source can't be mapped, in which
+* case the caller should fall back to copying through a buffer.
+*
+* Note that a source truncated while being copied makes us SIGBUS, just
+* like for any program mapping files.
+*/
+static int copyfile_data_mmap(copyfile_state_t s, off_t len)
+{
+	off_t off, moff, end;
+	size_t pgmask = (size_t)sysconf(_SC_PAGESIZE) - 1;
+	size_t mlen, skip;
+	char *map;
+	int ret;
+
+	copyfile_syscall(s);
+	if ((off = lseek(s->src_fd, 0, SEEK_CUR)) < 0)
+		return 1;
+
+	end = (len > s->sb.st_size - off) ? s->sb.st_size : off + len;
+
+	while (off < end)
+	{
+	moff = off & ~(off_t)pgmask;
+	skip = (size_t)(off - moff);
+	mlen = (size_t)MIN(end - moff, (off_t)COPYFILE_MMAP_WINDOW + (off_t)skip);
+
+	s->stats.syscalls += 2;
+	if ((map = mmap(NULL, mlen, PROT_READ, MAP_SHARED, s->src_fd, moff)) == MAP_FAILED)
+	{
+		/* the loop can take over from here */
+		copyfile_debug(3, "mmap of %s failed (%s)", s->src, strerror(errno));
+		copyfile_syscall(s);
+		return lseek(s->src_fd, off, SEEK_SET) < 0 ? -1 : 1;
+	}
+
+	(void)madvise(map, mlen, MADV_SEQUENTIAL);
+
+	ret = copyfile_data_write(s, map + skip, mlen - skip);
+
+	copyfile_syscall(s);
+	(void)munmap(map, mlen);
+
+	if (ret < 0)
+		return -1;
+
+	off += mlen - skip;
+	if (copyfile_progress(s, mlen - skip) < 0)
+		return -1;
+	}
+
+	/* leave the source where the loop would have */
+	copyfile_syscall(s);
+	if (lseek(s->src_fd, off, SEEK_SET) < 0)
+		return -1;
+
+	return 0;
+}
+
+/*
+* COPYFILE_ENGINE_PIPELINE: a reader thread fills a ring of buffers from
+* the source while the calling thread drains them to the destination, so
+* that a slow source and a slow destination are both kept busy at once.
+* lens[] holds how much went into each buffer, with 0 meaning EOF and -1
+* a read error (in err).  stop tells the reader the writer gave up.
+*/
+struct copyfile_pipe
+{
+	copyfile_state_t s;
+	char *buf;
+	size_t blen;
+	off_t len;
+	ssize_t lens[COPYFILE_PIPELINE_DEPTH];
+	unsigned head;
+	unsigned count;
+	int stop;
+	int err;
+	uint64_t syscalls;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+};
+
+static void *copyfile_pipe_reader(void *arg)
+{
+	struct copyfile_pipe *p = arg;
+	unsigned slot;
+	ssize_t n;
+
+	for (;;)
+	{
+	pthread_mutex_lock(&p->lock);
+	while (p->count == COPYFILE_PIPELINE_DEPTH && !p->stop)
+		pthread_cond_wait(&p->cond, &p->lock);
+	if (p->stop)
+	{
+		pthread_mutex_unlock(&p->lock);
+		break;
+	}
+	slot = (p->head + p->count) % COPYFILE_PIPELINE_DEPTH;
+	pthread_mutex_unlock(&p->lock);
+
+	n = 0;
+	if (p->len > 0)
+	{
+		p->syscalls++;
+		n = read(p->s->src_fd, p->buf + slot * p->blen, (size_t)MIN((off_t)p->blen, p->len));
+	}
+
+	pthread_mutex_lock(&p->lock);
+	if (n < 0)
+		p->err = errno;
+	else
+		p->len -= n;
+	p->lens[slot] = n;
+	p->count++;
+	pthread_cond_signal(&p->cond);
+	pthread_mutex_unlock(&p->lock);
+
+	if (n <= 0)
+		break;
+	}
+
+	return NULL;
+}
+
+/*
+* Copy up to len bytes, like copyfile_data_loop(), with a reader thread
+* running ahead of us.  The state's buffer is split into the ring of
+* io->blen sized slots.
+* Returns 1 if the thread can't be started, in which case the caller
+* should fall back to the plain loop.
+*/
+static int copyfile_data_pipeline(copyfile_state_t s, struct copyfile_io *io, off_t len)
+{
+	struct copyfile_pipe p;
+	pthread_t reader;
+	ssize_t n;
+	int ret = 0;
+
+	memset(&p, 0, sizeof p);
+	p.s = s;
+	p.buf = s->buf;
+	p.blen = io->blen;
+	p.len = len;
+
+	pthread_mutex_init(&p.lock, NULL);
+	pthread_cond_init(&p.cond, NULL);
+
+	if (pthread_create(&reader, NULL, copyfile_pipe_reader, &p) != 0)
+	{
+	pthread_cond_destroy(&p.cond);
+	pthread_mutex_destroy(&p.lock);
+	return 1;
+	}
+
+	for (;;)
+	{
+	pthread_mutex_lock(&p.lock);
+	while (p.count == 0)
+		pthread_cond_wait(&p.cond, &p.lock);
+	n = p.lens[p.head];
+	pthread_mutex_unlock(&p.lock);
+
+	if (n < 0)
+	{
+		errno = p.err;
+		copyfile_warn("reading from %s", s->src);
+		ret = -1;
+		break;
+	}
+
+	if (n == 0)
+		break;
+
+	if (copyfile_data_write(s, p.buf + p.head * p.blen, n) < 0 ||
+	    copyfile_progress(s, n) < 0)
+	{
+		ret = -1;
+		break;
+	}
+
+	pthread_mutex_lock(&p.lock);
+	p.head = (p.head + 1) % COPYFILE_PIPELINE_DEPTH;
+	p.count--;
+	pthread_cond_signal(&p.cond);
+	pthread_mutex_unlock(&p.lock);
+	}
+
+	pthread_mutex_lock(&p.lock);
+	p.stop = 1;
+	pthread_cond_signal(&p.cond);
+	pthread_mutex_unlock(&p.lock);
+
+	pthread_join(reader, NULL);
+	s->stats.syscalls += p.syscalls;
+
+	pthread_cond_destroy(&p.cond);
+	pthread_mutex_destroy(&p.lock);
+
+	return ret;
+}
+
+/*
+* Copy up to len bytes from the current offset of the source to the
+* current offset of the destination through a userland buffer, stopping
+* early if the source hits EOF.
+*/
+static int copyfile_data_loop(copyfile_state_t s, struct copyfile_io *io, off_t len)
+{
+	ssize_t nread;
+
+	while (len > 0)
+	{
+	copyfile_syscall(s);
+	if ((nread = read(s->src_fd, s->buf, (size_t)MIN((off_t)io->blen, len))) <= 0)
+	{
+		if (nread < 0 && errno == EINVAL && copyfile_undirect(s, &s->direct) == 0)
+			continue;
+		break;
+	}
+
+	if (copyfile_data_write(s, s->buf, nread) < 0)
+		return -1;
+
+	len -= nread;
+
+	if (io->bmax)
+		copyfile_data_tune(s, io, nread);
+
+	if (copyfile_progress(s, nread) < 0)
+		return -1;
+	}
+	if (len > 0 && nread < 0)
+	{
+	copyfile_warn("reading from %s", s->src);
+	return -1;
+	}
+
+	return 0;
+}
+
+/*
+* Copy len bytes (or up to EOF) at the current offsets, by whichever
+* means is available.
+*/
+static int copyfile_data_range(copyfile_state_t s, struct copyfile_io *io, off_t len)
+{
+	size_t iBlocksize = 0;
+	struct statfs sfs;
+	struct copyfile_fs *fs;
+
+#ifdef HAVE_COPY_FILE_RANGE
+	if (io->kernel)
+	{
+	int ret;
+
+	if ((ret = copyfile_data_kernel(s, len)) <= 0)
+		return ret;
+
+	io->kernel = 0;
+	}
+#endif
+
+	if (io->mmap)
+	{
+	int ret;
+
+	if ((ret = copyfile_data_mmap(s, len)) <= 0)
+		return ret;
+
+	io->mmap = 0;
+	}
+
+	if (io->blen == 0)
+	{
+	if (s->blksize != 0) {
+	iBlocksize = s->blksize;
+	} else if ((fs = copyfile_fs(s, s->sb.st_dev))->iosize != 0) {
+	iBlocksize = fs->iosize;
+	} else if (copyfile_syscall(s), fstatfs(s->src_fd, &sfs) == -1) {
+	iBlocksize = s->sb.st_blksize;
+	} else {
+	iBlocksize = fs->iosize = sfs.f_iosize;
+	}
+
+	/* direct I/O does best with big blocks */
+	if (s->direct && s->blksize == 0)
+	iBlocksize = COPYFILE_NOCACHE_BLOCK;
+
+	/*
+	* The buffer is kept around in the state for the next copy.  The
+	* pipeline needs one block for every stage of its ring.
+	*/
+	if (io->pipeline && s->blksize == 0 && s->sb.st_size > (off_t)iBlocksize)
+	iBlocksize = (size_t)MIN(s->sb.st_size, COPYFILE_PIPELINE_BLOCK);
+
+	io->blen = iBlocksize;
+	if (io->pipeline)
+	iBlocksize *= COPYFILE_PIPELINE_DEPTH;
+
+	if (copyfile_buf(s, iBlocksize) < 0)
+		return -1;
+
+	/* there is no point growing past what the file needs */
+	if (!io->pipeline && s->blksize == 0 && s->sb.st_size > (off_t)iBlocksize)
+	{
+		io->bmax = (size_t)MIN(s->sb.st_size, COPYFILE_BLOCKSIZE_MAX);
+		(void)clock_gettime(CLOCK_MONOTONIC, &io->since);
+	}
+	}
+
+	if (io->pipeline)
+	{
+	int ret;
+
+	if ((ret = copyfile_data_pipeline(s, io, len)) <= 0)
+		return ret;
+
+	io->pipeline = 0;
+	}
+
+	return copyfile_data_loop(s, io, len);
+}
+
+/*
+* Chunked copies: the source is cut into ranges of chunk bytes, handed
+* out in order (next is where the next one starts) to threads which each
+* copy theirs with pread(2)/pwrite(2), or copy_file_range(2) with explicit
+* offsets if kernel is set, so the descriptors' own offsets are left
+* alone.  The state is shared, so progress is reported under lock, and
+* the first error stops everyone.
+*/
+struct copyfile_chunks
+{
+	copyfile_state_t s;
+	int kernel;
+	size_t blen;
+	off_t size;
+	off_t chunk;
+	off_t next;
+	int error;
+	pthread_mutex_t lock;
+};
+
+struct copyfile_chunk_worker
+{
+	struct copyfile_chunks *c;
+	int kernel;
+	int direct;
+	char *buf;
+	uint64_t syscalls;
+	uint64_t charged;
+	uint64_t throttled_ns;
+	pthread_t thread;
+};
+
+/*
+* Copy the bytes between off and end.  Returns 0 or an errno value.
+*/
+static int copyfile_chunk_copy(struct copyfile_chunk_worker *w, off_t off, off_t end)
+{
+	struct copyfile_chunks *c = w->c;
+	copyfile_state_t s = c->s;
+	ssize_t n, nw;
+	size_t left;
+	int err;
+
+	while (off < end)
+	{
+#ifdef HAVE_COPY_FILE_RANGE
+	if (w->kernel)
+	{
+		off_t soff = off, doff = off;
+
+		w->syscalls++;
+		n = copy_file_range(s->src_fd, &soff, s->dst_fd, &doff,
+		    (size_t)copyfile_data_step(s, end - off), 0);
+
+		if (n < 0 && (errno == EXDEV || errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP))
+		{
+			copyfile_debug(3, "copy_file_range not usable (%s), falling back", strerror(errno));
+			w->kernel = 0;
+			continue;
+		}
+	}
+	else
+#endif
+	{
+		if (w->buf == NULL && (w->buf = copyfile_buf_alloc(c->blen)) == NULL)
+			return errno;
+
+		w->syscalls++;
+		n = pread(s->src_fd, w->buf, (size_t)MIN((off_t)c->blen, end - off), off);
+		if (n < 0 && errno == EINVAL && copyfile_undirect(s, &w->direct) == 0)
+			continue;
+
+		for (left = n > 0 ? (size_t)n : 0; left > 0; left -= nw)
+		{
+			w->syscalls++;
+			if ((nw = pwrite(s->dst_fd, w->buf + (n - left), left, off + (n - left))) < 0)
+			{
+				if (errno == EINTR || (errno == EINVAL && copyfile_undirect(s, &w->direct) == 0))
+				{
+					nw = 0;
+					continue;
+				}
+				copyfile_warn("writing to %s", s->dst);
+				return errno;
+			}
+		}
+	}
+
+	if (n < 0)
+	{
+		if (errno == EINTR)
+			continue;
+		copyfile_warn("copying from %s", s->src);
+		return errno;
+	}
+
+	/* the source shrank under us; the ftruncate() will sort that out */
+	if (n == 0)
+		break;
+
+	off += n;
+
+	w->throttled_ns += copyfile_throttle(s, (uint64_t)n, w->syscalls - w->charged);
+	w->charged = w->syscalls;
+
+	/* once someone has failed (or been cancelled), just stop */
+	pthread_mutex_lock(&c->lock);
+	if ((err = c->error) == 0 && copyfile_report(s, n) < 0)
+		err = errno;
+	pthread_mutex_unlock(&c->lock);
+
+	if (err != 0)
+		return err;
+	}
+
+	return 0;
+}
+
+static void *copyfile_chunk_worker(void *arg)
+{
+	struct copyfile_chunk_worker *w = arg;
+	struct copyfile_chunks *c = w->c;
+	off_t off, end;
+	int err;
+
+	for (;;)
+	{
+	pthread_mutex_lock(&c->lock);
+	if (c->error != 0 || c->next >= c->size)
+	{
+		pthread_mutex_unlock(&c->lock);
+		break;
+	}
+	off = c->next;
+	end = c->next = MIN(off + c->chunk, c->size);
+	pthread_mutex_unlock(&c->lock);
+
+	if ((err = copyfile_chunk_copy(w, off, end)) != 0)
+	{
+		pthread_mutex_lock(&c->lock);
+		if (c->error == 0)
+			c->error = err;
+		pthread_mutex_unlock(&c->lock);
+		break;
+	}
+	}
+
+	return NULL;
+}
+
+/*
+* Copy the whole source in chunks, with as many threads as the state asks
+* for, the calling thread being one of them.  Returns 1 if there's no
+* more than one thread to do it with, in which case the caller should
+* copy the file in one go instead.
+*/
+static int copyfile_data_chunked(copyfile_state_t s, struct copyfile_io *io)
+{
+	struct copyfile_chunks c;
+	struct copyfile_chunk_worker *workers;
+	unsigned nworkers, i, nstarted;
+	off_t nchunks;
+	long ncpu;
+
+	nworkers = s->nthreads;
+	if (nworkers == 0)
+	nworkers = (ncpu = sysconf(_SC_NPROCESSORS_ONLN)) > 0 ? (unsigned)ncpu : 1;
+
+	nchunks = s->sb.st_size / s->chunk_size + (s->sb.st_size % s->chunk_size != 0);
+	if ((off_t)nworkers > nchunks)
+	nworkers = (unsigned)nchunks;
+
+	if (nworkers <= 1 || (workers = calloc(nworkers, sizeof *workers)) == NULL)
+	return 1;
+
+	memset(&c, 0, sizeof c);
+	c.s = s;
+	c.kernel = io->kernel;
+	c.blen = s->blksize != 0 ? s->blksize : COPYFILE_CHUNK_BLOCK;
+	c.size = s->sb.st_size;
+	c.chunk = s->chunk_size;
+	pthread_mutex_init(&c.lock, NULL);
+
+	for (i = 0; i < nworkers; i++)
+	{
+	workers[i].c = &c;
+	workers[i].kernel = c.kernel;
+	workers[i].direct = s->direct;
+	}
+
+	/* if some threads can't be started, there's just fewer of them */
+	for (nstarted = 1; nstarted < nworkers; nstarted++)
+	if (pthread_create(&workers[nstarted].thread, NULL,
+	    copyfile_chunk_worker, &workers[nstarted]) != 0)
+		break;
+
+	copyfile_debug(2, "copying %s in chunks of %jd bytes with %u threads",
+	    s->src, (intmax_t)c.chunk, nstarted);
+
+	copyfile_chunk_worker(&workers[0]);
+
+	for (i = 0; i < nstarted; i++)
+	{
+	if (i > 0)
+		pthread_join(workers[i].thread, NULL);
+	s->stats.syscalls += workers[i].syscalls;
+	s->stats.throttled_ns += workers[i].throttled_ns;
+	s->tb_syscalls += workers[i].syscalls;
+	free(workers[i].buf);
+	}
+
+	free(workers);
+	pthread_mutex_destroy(&c.lock);
+
+	if (c.error != 0)
+	{
+	errno = c.error;
+	return -1;
+	}
+
+	return 0;
+}
+
+/*
+* pwrite(2) all of len bytes at off, for COPYFILE_DATA_DELTA.
+*/
+static int copyfile_data_pwrite(copyfile_state_t s, const char *ptr, size_t len, off_t off)
+{
+	ssize_t nw;
+
+	while (len > 0)
+	{
+	copyfile_syscall(s);
+	if ((nw = pwrite(s->dst_fd, ptr, len, off)) < 0)
+	{
+		if (errno == EINTR || (errno == EINVAL && copyfile_undirect(s, &s->direct) == 0))
+			continue;
+		copyfile_warn("writing to %s", s->dst);
+		return -1;
+	}
+	ptr += nw;
+	off += nw;
+	len -= (size_t)nw;
+	}
+
+	return 0;
+}
+
+/*
+* COPYFILE_DATA_DELTA: go through the part of the source the destination
+* already has block by block, and only write out the blocks that differ,
+* so that unchanged ones stay where they are on disk (and shared with any
+* snapshots).  Both files are read a window of blocks at a time into
+* halves of the state's buffer, the blocks compared with memcmp(3), which
+* libc already vectorises, and each run of differing blocks written back
+* in one go.  Any data past the destination's old end is left to the
+* caller to copy (returning 1), with both offsets set to where that starts.
+*/
+static int copyfile_data_delta(copyfile_state_t s, const struct stat *dst_sb)
+{
+	off_t off = 0, end = MIN(s->sb.st_size, dst_sb->st_size);
+	ssize_t nsrc, ndst;
+	size_t blen, wlen, at, run, n, written;
+
+	if ((blen = s->blksize) == 0 && (blen = dst_sb->st_blksize) == 0)
+		blen = COPYFILE_DELTA_BLOCK;
+	wlen = MAX(blen, COPYFILE_DELTA_WINDOW / blen * blen);
+
+	if (copyfile_buf(s, 2 * wlen) < 0)
+		return -1;
+
+	while (off < end)
+	{
+	copyfile_syscall(s);
+	if ((nsrc = pread(s->src_fd, s->buf, (size_t)MIN((off_t)wlen, end - off), off)) <= 0)
+	{
+		if (nsrc == 0)
+			break;
+		if (errno == EINTR)
+			continue;
+		copyfile_warn("reading from %s", s->src);
+		return -1;
+	}
+
+	copyfile_hash(s, s->buf, (size_t)nsrc);
+
+	/* whatever the destination can't give back counts as different */
+	copyfile_syscall(s);
+	if ((ndst = pread(s->dst_fd, s->buf + wlen, (size_t)nsrc, off)) < 0)
+		ndst = 0;
+
+	for (at = run = written = 0; at < (size_t)nsrc; at += n)
+	{
+		n = MIN(blen, (size_t)nsrc - at);
+
+		if (at + n <= (size_t)ndst && memcmp(s->buf + at, s->buf + wlen + at, n) == 0)
+		{
+			if (run < at && copyfile_data_pwrite(s, s->buf + run, at - run, off + run) < 0)
+				return -1;
+			written += at - run;
+			run = at + n;
+			s->stats.blocks_skipped++;
+		}
+	}
+
+	if (run < (size_t)nsrc && copyfile_data_pwrite(s, s->buf + run, nsrc - run, off + run) < 0)
+		return -1;
+	written += nsrc - run;
+
+	/* skipped blocks count as copied, but not as bytes copied */
+	s->copied += nsrc - written;
+	if (copyfile_progress(s, written) < 0)
+		return -1;
+
+	off += nsrc;
+	}
+
+	s->stats.syscalls += 2;
+	if (lseek(s->src_fd, off, SEEK_SET) < 0 || lseek(s->dst_fd, off, SEEK_SET) < 0)
+	{
+	copyfile_warn("seeking on %s", s->src);
+	return -1;
+	}
+
+	return 1;
+}
+
+/*
+* Copy a file of no more than COPYFILE_SMALL_FILE bytes with one read(2)
+* into the state's buffer and one write(2): its size being known, there
+* is no block size to work out, with an fstatfs(2), nor another read to
+* find the end.  Returns 1 if it turned out to be shorter than that, for
+* the caller to go on the usual way.
+*/
+static int copyfile_data_small(copyfile_state_t s)
+{
+	ssize_t n;
+
+	if (s->sb.st_size == 0)
+		return 0;
+
+	if (copyfile_buf(s, COPYFILE_SMALL_FILE) < 0)
+		return -1;
+
+	while (copyfile_syscall(s), (n = read(s->src_fd, s->buf, (size_t)s->sb.st_size)) < 0)
+	{
+	if (errno != EINTR)
+	{
+		copyfile_warn("reading from %s", s->src);
+		return -1;
+	}
+	}
+
+	if (copyfile_data_write(s, s->buf, (size_t)n) < 0 || copyfile_progress(s, n) < 0)
+		return -1;
+
+	return n < s->sb.st_size;
+}
+
+/*
+* COPYFILE_RESUME: work out how much of what an interrupted copy left in
+* the destination can be kept.  That's as far as it got, in whole blocks,
+* less anything in the last COPYFILE_RESUME_WINDOW before that which
+* doesn't match the source, since a crash can leave the tail of a file
+* unwritten or full of garbage, whatever its size says.  The window is
+* compared block by block, and the copy resumes at the first one that
+* differs -- unless that's the window's first, in which case the damage
+* may go back further and it starts over.  With a checksum to compute,
+* the source's data up to there is read through it.  Both offsets are
+* left where the copy is to go on from, which is also what's returned.
+*/
+static off_t copyfile_data_resume(copyfile_state_t s, const struct stat *dst_sb)
+{
+	off_t end, off, good;
+	ssize_t nsrc, ndst;
+	size_t blen, wlen, at, n;
+
+	if ((blen = s->blksize) == 0 && (blen = dst_sb->st_blksize) == 0)
+		blen = COPYFILE_DELTA_BLOCK;
+	wlen = MAX(blen, COPYFILE_RESUME_WINDOW / blen * blen);
+
+	good = end = MIN(s->sb.st_size, dst_sb->st_size) / (off_t)blen * (off_t)blen;
+	off = MAX(end - (off_t)wlen, 0);
+
+	if (end == 0)
+		return 0;
+
+	if (copyfile_buf(s, 2 * wlen) < 0)
+		return -1;
+
+	copyfile_syscall(s);
+	if ((nsrc = pread(s->src_fd, s->buf, (size_t)(end - off), off)) < 0)
+	{
+	copyfile_warn("reading from %s", s->src);
+	return -1;
+	}
+
+	/* whatever the destination can't give back doesn't match */
+	copyfile_syscall(s);
+	if ((ndst = pread(s->dst_fd, s->buf + wlen, (size_t)nsrc, off)) < 0)
+		ndst = 0;
+
+	for (at = 0; at < (size_t)(end - off); at += n)
+	{
+	n = MIN(blen, (size_t)(end - off) - at);
+	if (at + n > (size_t)MIN(nsrc, ndst) || memcmp(s->buf + at, s->buf + wlen + at, n) != 0)
+	{
+		good = at > 0 ? off + (off_t)at : 0;
+		break;
+	}
+	}
+
+	for (off = 0; s->hashing && off < good; off += nsrc)
+	{
+	copyfile_syscall(s);
+	if ((nsrc = pread(s->src_fd, s->buf, (size_t)MIN((off_t)(2 * wlen), good - off), off)) <= 0)
+	{
+		if (nsrc == 0)
+			errno = EIO;
+		copyfile_warn("reading from %s", s->src);
+		return -1;
+	}
+	copyfile_hash(s, s->buf, (size_t)nsrc);
+	}
+
+	s->stats.syscalls += 2;
+	if (lseek(s->src_fd, good, SEEK_SET) < 0 || lseek(s->dst_fd, good, SEEK_SET) < 0)
+	{
+	copyfile_warn("seeking on %s", s->src);
+	return -1;
+	}
+
+	copyfile_debug(2, "resuming %s at %jd of the %jd bytes in %s", s->src,
+	    (intmax_t)good, (intmax_t)dst_sb->st_size, s->dst);
+
+	/* what's kept counts as copied, but not as bytes copied */
+	s->copied = good;
+	s->stats.resumed += good;
+	return good;
+}
+
+/*
+* Walk the data regions of a sparse source with SEEK_DATA/SEEK_HOLE and
+* only copy those; the holes are left for the final ftruncate() in
+* copyfile_data() (or later, out-of-order writes) to recreate.  Returns
+* 1 if the source's filesystem can't report holes, in which case the
+* caller should copy it densely instead.
+*/
+static int copyfile_data_sparse(copyfile_state_t s, struct copyfile_io *io)
+{
+	/* from wherever COPYFILE_RESUME left off */
+	off_t data, hole = s->copied;
+
+	while (hole < s->sb.st_size)
+	{
+	copyfile_syscall(s);
+	if ((data = lseek(s->src_fd, hole, SEEK_DATA)) < 0)
+	{
+		/* ENXIO means there's nothing but a hole until EOF */
+		if (errno == ENXIO)
+		{
+			copyfile_hash_zeros(s, s->sb.st_size - hole);
+			s->stats.holes++;
+			s->stats.hole_bytes += s->sb.st_size - hole;
+			s->copied += s->sb.st_size - hole;
+			break;
+		}
+
+		if (hole == 0 && (errno == EINVAL || errno == ENOTTY || errno == EOPNOTSUPP))
+			return 1;
+
+		copyfile_warn("seeking data on %s", s->src);
+		return -1;
+	}
+
+	if (data > hole)
+	{
+		copyfile_hash_zeros(s, data - hole);
+		s->stats.holes++;
+		s->stats.hole_bytes += data - hole;
+		s->copied += data - hole;
+	}
+
+	s->stats.syscalls += 3;
+	if ((hole = lseek(s->src_fd, data, SEEK_HOLE)) < 0 ||
+	    lseek(s->src_fd, data, SEEK_SET) < 0 ||
+	    lseek(s->dst_fd, data, SEEK_SET) < 0)
+	{
+		copyfile_warn("seeking hole on %s", s->src);
+		return -1;
+	}
+
+	copyfile_debug(4, "copying data region [%jd, %jd)", (intmax_t)data, (intmax_t)hole);
+
+	if (copyfile_data_range(s, io, hole - data) < 0)
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+* Attempt to copy the data section of a file.  Using blockisize
+* is not necessarily the fastest -- it might be desirable to
+* specify a blocksize, somehow.  But it's a size that should be
+* guaranteed to work.
+*
+* By default, when both ends are regular files, the kernel is asked to
+* do the copy itself first; big sources it can't copy are mmap()ed, and
+* the buffer is only used if neither works.  COPYFILE_STATE_ENGINE can
+* pick one of these instead, or have the buffer read ahead of the writes
+* by another thread, still with the plain loop as a fallback.  With
+* COPYFILE_DATA_SPARSE, only the data regions of a source which
+* actually has holes are copied.
+*/
+static int copyfile_data(copyfile_state_t s)
+{
+	struct copyfile_io io;
+	struct stat dst_sb;
+	int ret = 1;
+	int regular, sparse, delta, resume, small = 0, rehash;
+	int direct = 0, sfl = 0, dfl = 0;
+	int err;
+
+	memset(&io, 0, sizeof io);
+	s->copied = 0;
+	s->progress_next = s->progress_interval;
+	copyfile_hash_start(s);
+
+	if (!s->dst_sb_ok)
+	s->dst_sb_ok = (copyfile_syscall(s), fstat(s->dst_fd, &s->dst_sb)) == 0;
+	dst_sb = s->dst_sb;
+	regular = S_ISREG(s->sb.st_mode) && s->dst_sb_ok && S_ISREG(dst_sb.st_mode);
+
+	switch (s->engine)
+	{
+	case COPYFILE_ENGINE_AUTO:
+	io.mmap = S_ISREG(s->sb.st_mode) && s->sb.st_size >= COPYFILE_MMAP_THRESHOLD;
+	/* FALLTHROUGH */
+	case COPYFILE_ENGINE_KERNEL:
+#ifdef HAVE_COPY_FILE_RANGE
+	/* the checksum can only be computed over data which passes by us */
+	io.kernel = regular && !s->hashing;
+#endif
+	break;
+	case COPYFILE_ENGINE_MMAP:
+	io.mmap = S_ISREG(s->sb.st_mode);
+	break;
+	case COPYFILE_ENGINE_PIPELINE:
+	io.pipeline = 1;
+	break;
+	}
+
+	/*
+	* Cloning goes first: there'd be no point preallocating blocks that
+	* are then shared with the source.
+	*/
+	if (s->flags & (COPYFILE_CLONE | COPYFILE_CLONE_FORCE))
+	{
+	if (!regular)
+		errno = EOPNOTSUPP;
+	else if ((ret = copyfile_data_clone(s)) < 0)
+		goto exit;
+
+	if (ret > 0)
+	{
+		if (s->flags & COPYFILE_CLONE_FORCE)
+		{
+			copyfile_warn("cannot clone %s", s->src);
+			ret = -1;
+			goto exit;
+		}
+		copyfile_debug(2, "not cloning %s: %s", s->src, strerror(errno));
+	}
+	}
+
+	/* whatever got cloned never went through the checksum */
+	rehash = s->copied > 0;
+
+	sparse = (s->flags & COPYFILE_DATA_SPARSE) && regular &&
+	    (off_t)s->sb.st_blocks * S_BLKSIZE < s->sb.st_size;
+
+	/* there's only something to compare against if dst has data already */
+	delta = (s->flags & COPYFILE_DATA_DELTA) && regular && dst_sb.st_size > 0;
+
+	/* which goes for COPYFILE_RESUME too, which delta copies don't need */
+	resume = (s->flags & COPYFILE_RESUME) && !delta && regular;
+	if (ret > 0 && resume && dst_sb.st_size > 0 && copyfile_data_resume(s, &dst_sb) < 0)
+	{
+	ret = -1;
+	goto exit;
+	}
+
+	/*
+	* A small file needs none of what follows, unless it's been asked
+	* for another engine than the loop, which is what it would get.
+	*/
+	if (ret > 0 && regular && !delta && !sparse && s->copied == 0 &&
+	    s->sb.st_size <= COPYFILE_SMALL_FILE &&
+	    (s->engine == COPYFILE_ENGINE_AUTO || s->engine == COPYFILE_ENGINE_LOOP))
+	{
+	if ((ret = copyfile_data_small(s)) < 0)
+		goto exit;
+	small = ret == 0;
+	}
+
+	/*
+	* COPYFILE_NOCACHE: have the kernel read the source ahead and drop
+	* what's been copied as we go (see copyfile_progress()), or bypass
+	* the cache altogether with direct I/O where the descriptors can do
+	* it.  Direct I/O wants large aligned blocks, so it isn't worth it
+	* for small files or the scattered writes of a delta or sparse copy,
+	* and the kernel engine would only go through the cache again.  The
+	* mmap engine always would.
+	*/
+	s->dropped = 0;
+	if (ret > 0 && (s->flags & COPYFILE_NOCACHE) && regular)
+	{
+	io.mmap = 0;
+	copyfile_syscall(s);
+	(void)posix_fadvise(s->src_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#ifdef O_DIRECT
+	if (ret > 0 && !delta && !sparse && s->sb.st_size >= COPYFILE_NOCACHE_BLOCK &&
+	    s->blksize % (size_t)sysconf(_SC_PAGESIZE) == 0 &&
+	    (direct = copyfile_direct(s, &sfl, &dfl) == 0))
+	{
+		copyfile_debug(3, "copying %s with direct I/O", s->src);
+		io.kernel = 0;
+	}
+#endif
+	}
+
+	/*
+	* Reserve the destination's blocks up front, so that the filesystem
+	* can lay them out in one go instead of one write at a time.  This
+	* would fill in the holes of a sparse copy, and is pointless if the
+	* destination is already big enough, or would be if it's to say how
+	* far the copy got for COPYFILE_RESUME.  Filesystems which can't do
+	* it (ZFS says EINVAL) are remembered, so they're only asked once.
+	*/
+	if (ret > 0 && s->prealloc && regular && !sparse && !resume && dst_sb.st_size < s->sb.st_size &&
+	    !copyfile_fs(s, dst_sb.st_dev)->nofalloc)
+	{
+	/* Ignore errors; this is merely advisory. */
+	copyfile_syscall(s);
+	if ((err = posix_fallocate(s->dst_fd, 0, s->sb.st_size)) != 0)
+	{
+		copyfile_debug(3, "not preallocating %s: %s", s->dst, strerror(err));
+		if (err == EINVAL || err == EOPNOTSUPP || err == ENODEV)
+			copyfile_fs(s, dst_sb.st_dev)->nofalloc = 1;
+	}
+	}
+
+	/*
+	* A socket (not being regular, it gets none of the above) just
+	* needs the data sending, unless it has to pass by us for the
+	* checksum.
+	*/
+	if (ret > 0 && s->sock && !s->hashing)
+	{
+	if ((ret = copyfile_data_send(s)) < 0)
+		goto exit;
+	}
+	else if (ret > 0 && delta)
+	{
+	if ((ret = copyfile_data_delta(s, &dst_sb)) < 0)
+		goto exit;
+	}
+	else if (ret > 0 && sparse)
+	{
+	if ((ret = copyfile_data_sparse(s, &io)) < 0)
+		goto exit;
+	}
+	else if (ret > 0 && regular && !s->hashing && !resume &&
+	    s->nthreads != 1 && s->chunk_threshold > 0 &&
+	    s->sb.st_size >= s->chunk_threshold)
+	{
+	if ((ret = copyfile_data_chunked(s, &io)) < 0)
+		goto exit;
+	}
+
+	if (ret > 0 && (ret = copyfile_data_range(s, &io, OFF_MAX)) < 0)
+		goto exit;
+
+	/* there's nothing past what was just written to a file we've only just made */
+	if (!s->sock && !(small && s->created) &&
+	    (copyfile_syscall(s), ftruncate(s->dst_fd, s->sb.st_size)) < 0)
+	{
+	ret = -1;
+	goto exit;
+	}
+
+	if (s->hashing)
+	{
+	uint32_t digest;
+
+	s->digest = ~s->crc;
+	if (rehash && copyfile_hash_fd(s, s->src_fd, &s->digest) < 0)
+	{
+		copyfile_warn("reading %s", s->src);
+		ret = -1;
+		goto exit;
+	}
+
+	if (s->flags & COPYFILE_VERIFY)
+	{
+		if (copyfile_hash_fd(s, s->dst_fd, &digest) < 0)
+		{
+			copyfile_warn("reading back %s", s->dst);
+			ret = -1;
+			goto exit;
+		}
+		if (digest != s->digest)
+		{
+#ifdef EINTEGRITY
+			errno = EINTEGRITY;
+#else
+			errno = EIO;
+#endif
+			copyfile_warn("%s doesn't match %s (crc32c %08x, expected %08x)",
+			    s->dst, s->src, digest, s->digest);
+			ret = -1;
+			goto exit;
+		}
+		copyfile_debug(3, "verified %s (crc32c %08x)", s->dst, digest);
+	}
+	}
+
+	/* make sure the callback gets to see the copy complete */
+	if (s->progress != NULL && s->copied != s->progress_next - MAX(s->progress_interval, 1))
+	{
+	s->progress_next = s->copied;
+	ret = copyfile_progress(s, 0);
+	}
+
+exit:
+#ifdef O_DIRECT
+	if (direct)
+	{
+	s->stats.syscalls += 2;
+	(void)fcntl(s->src_fd, F_SETFL, sfl);
+	(void)fcntl(s->dst_fd, F_SETFL, dfl);
+	s->direct = 0;
+	}
+#endif
+	if ((s->flags & COPYFILE_NOCACHE) && regular)
+	copyfile_nocache_drop(s);
+
 	return ret;
 }
 
@@ -596,30 +4709,191 @@ exit:
 static int copyfile_stat(copyfile_state_t s)
 {
 	struct timeval tval[2];
+	/* whatever the destination is known to have already is left alone */
+	const struct stat *dsb = s->dst_sb_ok ? &s->dst_sb : NULL;
+
 	/*
 	* NFS doesn't support chflags; ignore errors unless there's reason
 	* to believe we're losing bits.  (Note, this still won't be right
 	* if the server supports flags and we were trying to *remove* flags
 	* on a file that we copied, i.e., that we didn't create.)
 	*/
+	if (dsb == NULL || dsb->st_flags != s->sb.st_flags)
+	{
+	copyfile_syscall(s);
 	if (fchflags(s->dst_fd, (u_int)s->sb.st_flags))
 	if (errno != EOPNOTSUPP || s->sb.st_flags != 0)
 		copyfile_warn("%s: set flags (was: 0%07o)", s->dst, s->sb.st_flags);
+	}
 
 	/* If this fails, we don't care */
+	if (dsb == NULL || dsb->st_uid != s->sb.st_uid || dsb->st_gid != s->sb.st_gid)
+	{
+	copyfile_syscall(s);
 	(void)fchown(s->dst_fd, s->sb.st_uid, s->sb.st_gid);
+	}
 
-	/* This may have already been done in copyfile_security() */
+	/*
+	* This may have already been done in copyfile_security().  Writing
+	* the data (or changing the owner) may have cleared the set-id bits.
+	*/
+	if (dsb == NULL || (dsb->st_mode & ~S_IFMT) != (s->sb.st_mode & ~S_IFMT) ||
+	    (s->sb.st_mode & (S_ISUID | S_ISGID)))
+	{
+	copyfile_syscall(s);
 	(void)fchmod(s->dst_fd, s->sb.st_mode & ~S_IFMT);
+	}
 
 	tval[0].tv_sec = s->sb.st_atime;
 	tval[1].tv_sec = s->sb.st_mtime;
 	tval[0].tv_usec = tval[1].tv_usec = 0;
+	copyfile_syscall(s);
 	if (futimes(s->dst_fd, tval))
 		copyfile_warn("%s: set times", s->dst);
 	return 0;
 }
 
+/*
+* Make sure the extended attribute buffer can hold at least len bytes,
+* keeping what's in it already.
+*/
+static int copyfile_xbuf(copyfile_state_t s, size_t len)
+{
+	char *bp;
+
+	if (s->xbuflen >= len)
+		return 0;
+
+	len = MAX(len, 2 * s->xbuflen);
+	if ((bp = realloc(s->xbuf, len)) == NULL)
+		return -1;
+	s->xbuf = bp;
+	s->xbuflen = len;
+
+	return 0;
+}
+
+/*
+* Fetch the value of the extended attribute name into the state's buffer,
+* after the first off bytes (which hold the list of names).
+*/
+static ssize_t copyfile_xattr_get(copyfile_state_t s, int ns, const char *name, size_t off)
+{
+	ssize_t n;
+
+	for (;;)
+	{
+	copyfile_syscall(s);
+	n = extattr_get_fd(s->src_fd, ns, name, s->xbuf + off, s->xbuflen - off);
+
+	/* a full buffer may have cut the value short */
+	if (n < 0 || (size_t)n < s->xbuflen - off)
+		return n;
+
+	copyfile_syscall(s);
+	if ((n = extattr_get_fd(s->src_fd, ns, name, NULL, 0)) < 0 ||
+	    copyfile_xbuf(s, off + (size_t)n + 1) < 0)
+		return -1;
+	}
+}
+
+/*
+* Copy the extended attributes in the user and (if we're allowed to)
+* system namespaces.  Each namespace is listed with a single call into
+* the state's buffer, unless the buffer turns out to be too small;
+* the values then go in after the list.  Sources on filesystems without
+* extended attributes are remembered, so that the next files from there
+* don't cost a system call.
+*/
+static int copyfile_xattr(copyfile_state_t s)
+{
+	static const int namespaces[] = { EXTATTR_NAMESPACE_USER, EXTATTR_NAMESPACE_SYSTEM };
+	char name[UCHAR_MAX + 1];
+	ssize_t llen, vlen;
+	size_t i, at, len;
+	int ns;
+
+	if (copyfile_fs(s, s->sb.st_dev)->noxattr)
+		return 0;
+
+	if (copyfile_xbuf(s, COPYFILE_XATTR_BUF) < 0)
+		return -1;
+
+	for (i = 0; i < sizeof namespaces / sizeof *namespaces; i++)
+	{
+	ns = namespaces[i];
+
+	if (ns == EXTATTR_NAMESPACE_SYSTEM && s->nosysattr)
+		continue;
+
+	/* as with values, a full buffer may mean the list didn't fit */
+	for (;;)
+	{
+		copyfile_syscall(s);
+		if ((llen = extattr_list_fd(s->src_fd, ns, s->xbuf, s->xbuflen)) < 0 ||
+		    (size_t)llen < s->xbuflen)
+			break;
+
+		copyfile_syscall(s);
+		if ((llen = extattr_list_fd(s->src_fd, ns, NULL, 0)) < 0 ||
+		    copyfile_xbuf(s, (size_t)llen + 1) < 0)
+			break;
+	}
+
+	if (llen < 0)
+	{
+		if (errno == EOPNOTSUPP)
+		{
+			copyfile_debug(3, "%s has no extended attributes", s->src);
+			copyfile_fs(s, s->sb.st_dev)->noxattr = 1;
+			return 0;
+		}
+		if (errno == EPERM && ns == EXTATTR_NAMESPACE_SYSTEM)
+		{
+			s->nosysattr = 1;
+			continue;
+		}
+		copyfile_warn("listing extended attributes of %s", s->src);
+		return -1;
+	}
+
+	/* the list is made of names prefixed by their length */
+	for (at = 0; at < (size_t)llen; at += 1 + len)
+	{
+		len = (unsigned char)s->xbuf[at];
+		if (at + 1 + len > (size_t)llen)
+			break;
+		memcpy(name, s->xbuf + at + 1, len);
+		name[len] = '\0';
+
+		if ((vlen = copyfile_xattr_get(s, ns, name, (size_t)llen)) < 0)
+		{
+			/* it may well have been removed under us */
+			if (errno == ENOATTR)
+				continue;
+			copyfile_warn("getting extended attribute %s of %s", name, s->src);
+			return -1;
+		}
+
+		copyfile_syscall(s);
+		if (extattr_set_fd(s->dst_fd, ns, name, s->xbuf + llen, (size_t)vlen) < 0)
+		{
+			if (errno == EOPNOTSUPP)
+			{
+				copyfile_debug(3, "%s can't have extended attributes", s->dst);
+				return 0;
+			}
+			copyfile_warn("setting extended attribute %s on %s", name, s->dst);
+			return -1;
+		}
+
+		copyfile_debug(4, "copied extended attribute %s", name);
+	}
+	}
+
+	return 0;
+}
+
 /*
 * API interface into getting data from the opaque data type.
 */
@@ -645,14 +4919,64 @@ int copyfile_state_get(copyfile_state_t s, uint32_t flag, void *ret)
 	case COPYFILE_STATE_DST_FILENAME:
 		*(char**)ret = s->dst;
 		break;
-#if 0
+	case COPYFILE_STATE_BLOCKSIZE:
+		*(size_t*)ret = s->blksize;
+		break;
+	case COPYFILE_STATE_PREALLOCATE:
+		*(int*)ret = s->prealloc;
+		break;
+	case COPYFILE_STATE_THREADS:
+		*(unsigned*)ret = s->nthreads;
+		break;
 	case COPYFILE_STATE_STATS:
-		ret = s->stats.global;
+		*(struct copyfile_stats*)ret = s->stats;
 		break;
 	case COPYFILE_STATE_PROGRESS_CB:
-		ret = s->callbacks.progress;
+		*(copyfile_progress_t*)ret = s->progress;
+		break;
+	case COPYFILE_STATE_PROGRESS_CTX:
+		*(void**)ret = s->progress_ctx;
+		break;
+	case COPYFILE_STATE_PROGRESS_INTERVAL:
+		*(off_t*)ret = s->progress_interval;
+		break;
+	case COPYFILE_STATE_ENGINE:
+		*(int*)ret = s->engine;
+		break;
+	case COPYFILE_STATE_CHUNK_THRESHOLD:
+		*(off_t*)ret = s->chunk_threshold;
+		break;
+	case COPYFILE_STATE_CHUNK_SIZE:
+		*(off_t*)ret = s->chunk_size;
+		break;
+	case COPYFILE_STATE_WAS_CLONED:
+		*(int*)ret = s->cloned;
+		break;
+	case COPYFILE_STATE_UPDATE_COMPARE:
+		*(int*)ret = s->update_compare;
+		break;
+	case COPYFILE_STATE_CHECKSUM:
+		*(int*)ret = s->checksum;
+		break;
+	case COPYFILE_STATE_DIGEST:
+		*(uint32_t*)ret = s->digest;
+		break;
+	case COPYFILE_STATE_DURABILITY:
+		*(int*)ret = s->durability;
+		break;
+	case COPYFILE_STATE_MANIFEST:
+		*(char**)ret = s->manifest;
+		break;
+	case COPYFILE_STATE_RATE_BYTES:
+		pthread_mutex_lock(&s->tb->lock);
+		*(uint64_t*)ret = s->tb->bps;
+		pthread_mutex_unlock(&s->tb->lock);
+		break;
+	case COPYFILE_STATE_RATE_OPS:
+		pthread_mutex_lock(&s->tb->lock);
+		*(uint64_t*)ret = s->tb->ops;
+		pthread_mutex_unlock(&s->tb->lock);
 		break;
-#endif
 	default:
 		errno = EINVAL;
 		ret = NULL;
@@ -667,17 +4991,8 @@ int copyfile_state_get(copyfile_state_t s, uint32_t flag, void *ret)
 */
 int copyfile_state_set(copyfile_state_t s, uint32_t flag, const void * thing)
 {
-#define copyfile_set_string(DST, SRC) \
-	do {					\
-	if (SRC != NULL) {			\
-		DST = strdup((char *)SRC);		\
-	} else {				\
-		if (DST != NULL) {			\
-		free(DST);			\
-		}					\
-		DST = NULL;				\
-	}					\
-	} while (0)
+#define copyfile_set_string(NAME, SRC) \
+	copyfile_name(&s->NAME, &s->NAME##buf, &s->NAME##buflen, (const char *)SRC)
 
 	if (thing == NULL)
 	{
@@ -694,19 +5009,107 @@ int copyfile_state_set(copyfile_state_t s, uint32_t flag, const void * thing)
 		s->dst_fd = *(int*)thing;
 		break;
 	case COPYFILE_STATE_SRC_FILENAME:
-		copyfile_set_string(s->src, thing);
+		if (copyfile_set_string(src, thing) < 0)
+			return -1;
 		break;
 	case COPYFILE_STATE_DST_FILENAME:
-		copyfile_set_string(s->dst, thing);
+		if (copyfile_set_string(dst, thing) < 0)
+			return -1;
+		break;
+	case COPYFILE_STATE_BLOCKSIZE:
+		s->blksize = *(size_t*)thing;
+		break;
+	case COPYFILE_STATE_PREALLOCATE:
+		s->prealloc = *(int*)thing;
+		break;
+	case COPYFILE_STATE_THREADS:
+		s->nthreads = *(unsigned*)thing;
 		break;
-#if 0
 	case COPYFILE_STATE_STATS:
-		s->stats.global = thing;
+		s->stats = *(const struct copyfile_stats*)thing;
+		/* the throttle's been charged for everything up to now */
+		s->tb_syscalls = s->stats.syscalls;
 		break;
 	case COPYFILE_STATE_PROGRESS_CB:
-		s->callbacks.progress = thing;
+		s->progress = *(const copyfile_progress_t*)thing;
+		break;
+	case COPYFILE_STATE_PROGRESS_CTX:
+		s->progress_ctx = *(void * const*)thing;
+		break;
+	case COPYFILE_STATE_PROGRESS_INTERVAL:
+		s->progress_interval = *(const off_t*)thing;
+		break;
+	case COPYFILE_STATE_ENGINE:
+		switch (*(const int*)thing)
+		{
+		case COPYFILE_ENGINE_AUTO:
+		case COPYFILE_ENGINE_LOOP:
+		case COPYFILE_ENGINE_KERNEL:
+		case COPYFILE_ENGINE_MMAP:
+		case COPYFILE_ENGINE_PIPELINE:
+			s->engine = *(const int*)thing;
+			break;
+		default:
+			errno = EINVAL;
+			return -1;
+		}
+		break;
+	case COPYFILE_STATE_UPDATE_COMPARE:
+		s->update_compare = *(const int*)thing;
+		break;
+	case COPYFILE_STATE_CHECKSUM:
+		switch (*(const int*)thing)
+		{
+		case COPYFILE_CHECKSUM_NONE:
+		case COPYFILE_CHECKSUM_CRC32C:
+			s->checksum = *(const int*)thing;
+			break;
+		default:
+			errno = EINVAL;
+			return -1;
+		}
+		break;
+	case COPYFILE_STATE_DURABILITY:
+		switch (*(const int*)thing)
+		{
+		case COPYFILE_DURABILITY_NONE:
+		case COPYFILE_DURABILITY_FILE:
+		case COPYFILE_DURABILITY_GROUP:
+			s->durability = *(const int*)thing;
+			break;
+		default:
+			errno = EINVAL;
+			return -1;
+		}
+		break;
+	case COPYFILE_STATE_MANIFEST:
+		free(s->manifest);
+		s->manifest = NULL;
+		if (*(const char *)thing != '\0' && (s->manifest = strdup(thing)) == NULL)
+			return -1;
+		break;
+	case COPYFILE_STATE_RATE_BYTES:
+		copyfile_throttle_set(s, &s->tb->bps, *(const uint64_t*)thing);
+		break;
+	case COPYFILE_STATE_RATE_OPS:
+		copyfile_throttle_set(s, &s->tb->ops, *(const uint64_t*)thing);
+		break;
+	case COPYFILE_STATE_CHUNK_THRESHOLD:
+		if (*(const off_t*)thing < 0)
+		{
+			errno = EINVAL;
+			return -1;
+		}
+		s->chunk_threshold = *(const off_t*)thing;
+		break;
+	case COPYFILE_STATE_CHUNK_SIZE:
+		if (*(const off_t*)thing <= 0)
+		{
+			errno = EINVAL;
+			return -1;
+		}
+		s->chunk_size = *(const off_t*)thing;
 		break;
-#endif
 	default:
 		errno = EINVAL;
 		return -1;
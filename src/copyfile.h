@@ -36,6 +36,8 @@
 
 /* private */
 #include <sys/cdefs.h>
+#include <sys/types.h>
+#include <stddef.h>
 #include <stdint.h>
 
 __BEGIN_DECLS
@@ -58,9 +60,39 @@ typedef uint32_t copyfile_flags_t;
 int copyfile(const char *from, const char *to, copyfile_state_t state, copyfile_flags_t flags);
 int fcopyfile(int from_fd, int to_fd, copyfile_state_t, copyfile_flags_t flags);
 
+/* receives:
+ *   from_dirfd	directory relative paths in from are looked up from, or AT_FDCWD
+ *   to_dirfd	same, for to
+ *   (otherwise the same as copyfile())
+ */
+
+int copyfileat(int from_dirfd, const char *from, int to_dirfd, const char *to, copyfile_state_t state, copyfile_flags_t flags);
+
+/* receives:
+ *   pairs	array of n source/destination paths to copy
+ *   state	reused for every pair, may be NULL
+ *   flags	(described below), applied to every pair
+ *   results	if not NULL, array of n errno values, 0 where it worked
+ * returns:
+ *   int	negative if any of the copies failed
+ */
+
+struct copyfile_pair {
+	const char *src;
+	const char *dst;
+};
+
+int copyfile_batch(const struct copyfile_pair *pairs, size_t n, copyfile_state_t state, copyfile_flags_t flags, int *results);
+
 int copyfile_state_free(copyfile_state_t);
 copyfile_state_t copyfile_state_alloc(void);
 
+/*
+ * Ready a state for an unrelated copy, as if it were new but for its
+ * settings and what it has allocated or learnt about filesystems.
+ */
+int copyfile_state_reset(copyfile_state_t);
+
 
 int copyfile_state_get(copyfile_state_t s, uint32_t flag, void * dst);
 int copyfile_state_set(copyfile_state_t s, uint32_t flag, const void * src);
@@ -69,6 +101,133 @@ int copyfile_state_set(copyfile_state_t s, uint32_t flag, const void * src);
 #define COPYFILE_STATE_SRC_FILENAME	2
 #define COPYFILE_STATE_DST_FD		3
 #define COPYFILE_STATE_DST_FILENAME	4
+#define COPYFILE_STATE_BLOCKSIZE	5 /* size_t, 0 to size automatically */
+#define COPYFILE_STATE_PREALLOCATE	6 /* int, nonzero (default) to preallocate dst */
+#define COPYFILE_STATE_THREADS		7 /* unsigned, for trees and chunks; 0 for one per CPU */
+#define COPYFILE_STATE_STATS		8 /* struct copyfile_stats */
+#define COPYFILE_STATE_PROGRESS_CB	9 /* copyfile_progress_t */
+#define COPYFILE_STATE_PROGRESS_CTX	10 /* void *, passed to the callback */
+#define COPYFILE_STATE_PROGRESS_INTERVAL 11 /* off_t, bytes between calls */
+#define COPYFILE_STATE_ENGINE		12 /* int, COPYFILE_ENGINE_* */
+#define COPYFILE_STATE_CHUNK_THRESHOLD	13 /* off_t, split files this big; 0 never */
+#define COPYFILE_STATE_CHUNK_SIZE	14 /* off_t, bytes per chunk */
+#define COPYFILE_STATE_WAS_CLONED	15 /* int, get only: last file was cloned */
+#define COPYFILE_STATE_UPDATE_COMPARE	16 /* int, nonzero for UPDATE to compare data */
+#define COPYFILE_STATE_CHECKSUM		17 /* int, COPYFILE_CHECKSUM_* */
+#define COPYFILE_STATE_DIGEST		18 /* uint32_t, get only: last file's checksum */
+#define COPYFILE_STATE_DURABILITY	19 /* int, COPYFILE_DURABILITY_* */
+#define COPYFILE_STATE_MANIFEST		20 /* const char *, tree manifest path; "" for none */
+#define COPYFILE_STATE_RATE_BYTES	21 /* uint64_t, data bytes per second; 0 for no limit */
+#define COPYFILE_STATE_RATE_OPS		22 /* uint64_t, system calls per second; 0 for no limit */
+
+/*
+ * With more than one thread, a regular file of at least
+ * COPYFILE_STATE_CHUNK_THRESHOLD bytes (1 GiB by default) is split into
+ * chunks of COPYFILE_STATE_CHUNK_SIZE (32 MiB), which are copied at the
+ * same time with positioned I/O.  Sparse copies are never split.
+ */
+
+/*
+ * How the data gets copied.  Whichever is picked, copying through a
+ * buffer is what happens if it can't be used for the files at hand.
+ */
+#define COPYFILE_ENGINE_AUTO	0 /* default: kernel, then mmap, then the loop */
+#define COPYFILE_ENGINE_LOOP	1 /* read(2)/write(2) through a buffer */
+#define COPYFILE_ENGINE_KERNEL	2 /* copy_file_range(2) */
+#define COPYFILE_ENGINE_MMAP	3 /* write(2) straight out of an mmap(2) */
+#define COPYFILE_ENGINE_PIPELINE 4 /* buffers read ahead by another thread */
+
+/*
+ * Checksums computed over the data as it's copied, which COPYFILE_VERIFY
+ * (defaulting to CRC32C) checks the destination against afterwards.
+ * Asking for one keeps the data from being copied by the kernel on its
+ * own, or in chunks; a clone's is read from the source instead.
+ */
+#define COPYFILE_CHECKSUM_NONE	0
+#define COPYFILE_CHECKSUM_CRC32C 1 /* Castagnoli, as in iSCSI and ext4 */
+
+/*
+ * When what was copied is fsync()ed: never (the default), each file as
+ * soon as it's written and each directory once its entries are in, or
+ * all of them in one go at the end of the copyfile(), fcopyfile() or
+ * copyfile_batch() call -- a few dozen at a time for big trees -- which
+ * is much cheaper on ZFS or UFS with soft updates.  The directory the
+ * destination itself went into is included.
+ */
+#define COPYFILE_DURABILITY_NONE	0
+#define COPYFILE_DURABILITY_FILE	1
+#define COPYFILE_DURABILITY_GROUP	2
+
+/*
+ * COPYFILE_STATE_RATE_BYTES and COPYFILE_STATE_RATE_OPS limit a copy,
+ * with all the threads of a tree, batch or chunked file drawing on the
+ * same allowance, which builds up to at most a tenth of a second's
+ * worth while unused.  Unlike any other setting, they may be changed
+ * from another thread while the copy is going on, taking effect within
+ * a fraction of a second.
+ */
+
+/*
+ * With COPYFILE_STATE_MANIFEST, a COPYFILE_RECURSIVE copy writes an index
+ * of the tree it copied to that file, and the next copy of the same tree
+ * leaves alone the files whose size, inode and times are the same as
+ * then, without looking at the destination at all (they count as
+ * uptodate in the stats), nor copying the metadata of directories left
+ * entirely as they were.  The destination is assumed not to have been
+ * touched in between.  It's ignored by COPYFILE_MOVE.
+ */
+
+/*
+ * COPYFILE_RESUME continues the copy of a regular file an earlier one
+ * didn't finish, keeping the data already in the destination -- but for
+ * what it finds, at its end, not to match the source -- instead of
+ * starting over; COPYFILE_UNLINK is ignored, and COPYFILE_ATOMIC always
+ * starts with nothing to keep.  A copy that fails or is cancelled
+ * leaves what it wrote in place, for the next one to resume.  To have
+ * the destination's size tell how far the copy got, it is neither
+ * preallocated nor copied in chunks.  A file's progress callbacks start
+ * at where it resumed, so what they're told has been copied is also how
+ * much of the destination is written, which callers can keep as a
+ * checkpoint.  With a checksum, the data kept is read again so that
+ * it's part of it, and checked along with the rest by COPYFILE_VERIFY.
+ */
+
+/*
+ * Running totals for everything copied with a state, including by the
+ * threads it spread a tree or batch across.  Setting them (e.g. to all
+ * zeros) replaces them.
+ */
+struct copyfile_stats {
+	uint64_t bytes;		/* data bytes copied */
+	uint64_t files;		/* non-directories copied */
+	uint64_t clones;	/* ... of which were cloned */
+	uint64_t uptodate;	/* files left alone by COPYFILE_UPDATE */
+	uint64_t links;		/* hard links recreated instead of copied */
+	uint64_t renames;	/* files and trees COPYFILE_MOVE renamed instead */
+	uint64_t syscalls;	/* system calls made copying data and metadata */
+	uint64_t holes;		/* holes skipped in sparse files */
+	uint64_t hole_bytes;	/* ... and their total size */
+	uint64_t blocks_skipped; /* blocks COPYFILE_DATA_DELTA found unchanged */
+	uint64_t resumed;	/* data bytes COPYFILE_RESUME kept of partial copies */
+	uint64_t open_ns;	/* wall time spent opening files */
+	uint64_t data_ns;	/* ... copying data */
+	uint64_t stat_ns;	/* ... and copying POSIX information */
+	uint64_t throttled_ns;	/* ... and held back by COPYFILE_STATE_RATE_* */
+};
+
+/*
+ * Called every COPYFILE_STATE_PROGRESS_INTERVAL bytes (1 MiB by default)
+ * of a file's data, and once more when it's done, with how much of it has
+ * been copied so far; holes skipped count as copied.  Returning
+ * COPYFILE_QUIT cancels the copy, which then fails with ECANCELED.  When
+ * copying with several threads, it may be called from any of them at the
+ * same time, each with its own state.  The chunks of a file are reported
+ * one at a time, from whichever thread copied them.
+ */
+typedef int (*copyfile_progress_t)(copyfile_state_t s, off_t copied, off_t total, void *ctx);
+
+#define COPYFILE_CONTINUE	0
+#define COPYFILE_QUIT		2
 
 #define	COPYFILE_DISABLE_VAR	"COPYFILE_DISABLE"
 
@@ -81,12 +240,22 @@ int copyfile_state_set(copyfile_state_t s, uint32_t flag, const void * src);
 #define COPYFILE_METADATA   (COPYFILE_XATTR)
 #define COPYFILE_ALL	    (COPYFILE_METADATA | COPYFILE_DATA)
 
+#define COPYFILE_RESUME		(1<<14) /* carry on from where a partial dst ends */
+#define COPYFILE_RECURSIVE	(1<<15) /* descend into directories */
 #define COPYFILE_CHECK		(1<<16) /* return flags for xattr or acls if set */
 #define COPYFILE_EXCL		(1<<17) /* fail if destination exists */
 #define COPYFILE_NOFOLLOW_SRC	(1<<18) /* don't follow if source is a symlink */
 #define COPYFILE_NOFOLLOW_DST	(1<<19) /* don't follow if dst is a symlink */
-#define COPYFILE_MOVE		(1<<20) /* unlink src after copy */
+#define COPYFILE_MOVE		(1<<20) /* unlink src after copy, or just rename it */
 #define COPYFILE_UNLINK		(1<<21) /* unlink dst before copy */
+#define COPYFILE_NOCACHE	(1<<22) /* keep the data out of the page cache */
+#define COPYFILE_UPDATE		(1<<23) /* leave dst alone if it's up to date */
+#define COPYFILE_CLONE		(1<<24) /* clone the data if possible */
+#define COPYFILE_CLONE_FORCE	(1<<25) /* clone the data or fail */
+#define COPYFILE_DATA_DELTA	(1<<26) /* only rewrite the blocks of dst that differ */
+#define COPYFILE_DATA_SPARSE	(1<<27) /* only copy the data regions of a sparse src */
+#define COPYFILE_VERIFY		(1<<28) /* read dst back and check its checksum */
+#define COPYFILE_ATOMIC		(1<<29) /* write a temporary file, then rename it to dst */
 #define COPYFILE_NOFOLLOW	(COPYFILE_NOFOLLOW_SRC | COPYFILE_NOFOLLOW_DST)
 
 #define COPYFILE_VERBOSE	(1<<30)